@@ -0,0 +1,597 @@
+// Deduplicated dump archive. Dumps are split into erase blocks and each
+// unique block is stored once as a chunk file, named by its CRC32 and a
+// 64-bit FNV-1a hash. A dump becomes a manifest holding the TCRT header and
+// the chunk keys of its blocks. Blocks whose device CRC32 matches a stored
+// chunk are not read over the link.
+//
+// <store>/manifests/<name>         manifest of one dump
+// <store>/<xx>/<crc32>-<hash>      chunk, xx are the first two digits of the CRC32
+// <store>/lock                     shared while archiving or restoring, exclusive for gc
+//
+// Blocks are matched to stored chunks by the device CRC32 alone, like --diff
+// does. Chunks are synced to disk before the manifest that refers to them.
+
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <glob.h>
+#include <limits.h>
+#include <ctype.h>
+
+#define MANIFEST_SIGNATURE "TCARCH01"
+#define MANIFEST_DIRECTORY "manifests"
+#define STORE_LOCK_FILE "lock"
+#define CHUNK_NAME_LENGTH 25        // <crc32>-<hash>
+#define TEMP_SUFFIX ".tmp"
+
+#pragma pack(push)
+#pragma pack(1)
+struct ChunkKey
+{
+    uint32_t crc32;
+    uint64_t hash;
+};
+
+struct ManifestHeader
+{
+    uint8_t signature[8];
+    uint32_t block_size;
+    uint32_t block_count;
+    TcrtHeader tcrt_header;
+    // Followed by block_count chunk keys
+};
+#pragma pack(pop)
+
+struct ArchiveSummary
+{
+    uint32_t blocks_stored;     // Already in the store, found by the device CRC32
+    uint32_t blocks_read;
+    uint32_t chunks_added;
+};
+
+static char *store_path = NULL;
+
+static uint64_t calculate_chunk_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for(size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static int compare_chunk_keys(const void *a, const void *b)
+{
+    const ChunkKey *x = (const ChunkKey *)a, *y = (const ChunkKey *)b;
+
+    if(x->crc32 != y->crc32)
+    {
+        return x->crc32 < y->crc32 ? -1 : 1;
+    }
+
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static void get_chunk_directory(uint32_t crc32, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%02x", store_path, crc32 >> 24);
+}
+
+static void get_chunk_path(ChunkKey *key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%02x/%08x-%016llx", store_path, key->crc32 >> 24, key->crc32,
+             (unsigned long long)key->hash);
+}
+
+static void get_manifest_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s/" MANIFEST_DIRECTORY "/%s", store_path, name);
+}
+
+// Sync the directory holding path, so a new or renamed entry survives a crash
+static bool sync_parent_directory(const char *path)
+{
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+
+    char *separator = strrchr(directory, '/');
+    if(separator == directory)
+    {
+        separator[1] = '\0';
+    }
+    else if(separator)
+    {
+        *separator = '\0';
+    }
+    else
+    {
+        snprintf(directory, sizeof(directory), ".");
+    }
+
+    int file = open_file(directory, O_RDONLY|O_DIRECTORY);
+    bool result = file != -1 && fsync(file) == 0;
+
+    if(file != -1)
+    {
+        close(file);
+    }
+
+    return result;
+}
+
+static bool make_directory(const char *path)
+{
+    if(mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) == 0)
+    {
+        if(sync_parent_directory(path))
+        {
+            return true;
+        }
+    }
+    else if(errno == EEXIST)
+    {
+        return true;
+    }
+
+    fprintf(stderr, "Failed to create %s. %s\n", path, strerror(errno));
+    return false;
+}
+
+// Returns the lock file, or -1 on failure. Archiving and restoring share the
+// store, gc needs it alone as it removes what no manifest refers to yet.
+static int lock_store(int operation)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" STORE_LOCK_FILE, store_path);
+
+    int file = open_file(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(file == -1)
+    {
+        fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int result = flock(file, operation|LOCK_NB);
+    if(result != 0 && errno == EWOULDBLOCK)
+    {
+        printf(operation == LOCK_EX ? "Waiting for archive jobs to finish\n" : "Waiting for gc to finish\n");
+        fflush(stdout);
+
+        do
+        {
+            result = flock(file, operation);
+        }
+        while(result != 0 && errno == EINTR);
+    }
+
+    if(result != 0)
+    {
+        fprintf(stderr, "Failed to lock %s. %s\n", path, strerror(errno));
+        close(file);
+        return -1;
+    }
+
+    return file;
+}
+
+// Write a file under a temporary name, sync it and rename it into place, so
+// the store never holds a partial chunk or manifest, even after a crash
+static bool write_store_file(const char *path, void *data, size_t size, void *more_data = NULL, size_t more_size = 0)
+{
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s" TEMP_SUFFIX, path);
+
+    int file = open_file(temp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(file == -1)
+    {
+        fprintf(stderr, "Failed to open %s. %s\n", temp_path, strerror(errno));
+        return false;
+    }
+
+    bool result = write_file(file, data, size) && write_file(file, more_data, more_size) && fsync(file) == 0;
+    result = close(file) == 0 && result && rename(temp_path, path) == 0 && sync_parent_directory(path);
+
+    if(!result)
+    {
+        fprintf(stderr, "Failed to write %s. %s\n", path, strerror(errno));
+        unlink(temp_path);
+    }
+
+    return result;
+}
+
+// Find the stored chunk for a block from the CRC32 computed by the Tapecart.
+// Only a single chunk of the right length counts as a match.
+static bool find_stored_chunk(uint32_t crc32, uint32_t length, ChunkKey *key)
+{
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/%02x/%08x-????????????????", store_path, crc32 >> 24, crc32);
+
+    glob_t chunks = {};
+    bool result = false;
+
+    if(glob(pattern, 0, NULL, &chunks) == 0 && chunks.gl_pathc == 1)
+    {
+        struct stat chunk_stat;
+        unsigned long long hash;
+        const char *name = strrchr(chunks.gl_pathv[0], '/') + 1;
+
+        if(stat(chunks.gl_pathv[0], &chunk_stat) == 0 && chunk_stat.st_size == length &&
+           sscanf(name, "%*8x-%16llx", &hash) == 1)
+        {
+            key->crc32 = crc32;
+            key->hash = hash;
+            result = true;
+        }
+    }
+
+    globfree(&chunks);
+    return result;
+}
+
+static bool store_chunk(uint8_t *data, uint32_t length, ChunkKey *key, ArchiveSummary *summary)
+{
+    key->crc32 = calculate_crc32(data, length);
+    key->hash = calculate_chunk_hash(data, length);
+
+    char path[PATH_MAX];
+    get_chunk_path(key, path, sizeof(path));
+
+    if(access(path, F_OK) == 0)
+    {
+        return true;
+    }
+
+    char directory[PATH_MAX];
+    get_chunk_directory(key->crc32, directory, sizeof(directory));
+
+    summary->chunks_added++;
+    return make_directory(directory) && write_store_file(path, data, length);
+}
+
+static bool is_temp_file(const char *path)
+{
+    size_t length = strlen(path);
+    return length >= strlen(TEMP_SUFFIX) && strcmp(path + length - strlen(TEMP_SUFFIX), TEMP_SUFFIX) == 0;
+}
+
+// Parse a chunk file name, <crc32>-<hash> in lower case hex
+static bool parse_chunk_name(const char *name, ChunkKey *key)
+{
+    for(int i = 0; i < CHUNK_NAME_LENGTH; i++)
+    {
+        bool valid = i == 8 ? name[i] == '-' : isdigit(name[i]) || (name[i] >= 'a' && name[i] <= 'f');
+        if(!valid)
+        {
+            return false;
+        }
+    }
+
+    unsigned long long hash;
+    if(sscanf(name, "%8x-%16llx", &key->crc32, &hash) != 2)
+    {
+        return false;
+    }
+
+    key->hash = hash;
+    return true;
+}
+
+// Manifests are addressed by a plain name inside the store
+static bool prepare_store(const char *name)
+{
+    if(strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_temp_file(name))
+    {
+        fprintf(stderr, "Invalid archive name %s\n", name);
+        return false;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" MANIFEST_DIRECTORY, store_path);
+
+    return make_directory(store_path) && make_directory(path);
+}
+
+static bool archive_tcrt(int fd, const char *name)
+{
+    bool result = false;
+
+    int lock = prepare_store(name) ? lock_store(LOCK_SH) : -1;
+    if(lock == -1)
+    {
+        return false;
+    }
+
+    TcrtHeader header = {};
+    DeviceSizes device_sizes;
+    if(read_tcrt_header(fd, &header) && read_device_sizes(fd, &device_sizes))
+    {
+        result = true;
+        uint32_t flash_block_size = device_sizes.page_size * device_sizes.erase_pages;
+        uint32_t block_size = flash_block_size ? flash_block_size : FAST_FLASH_MAX_LENGTH;
+        uint32_t block_count = (header.flash_content_length + block_size - 1) / block_size;
+        uint8_t *buffer = (uint8_t *)malloc(block_size);
+        ChunkKey *keys = (ChunkKey *)calloc(block_count ? block_count : 1, sizeof(ChunkKey));
+        ArchiveSummary summary = {};
+        RetryReport report = {};
+        bool crc_supported = true;
+
+        for(uint32_t i = 0, block = 0; i < header.flash_content_length && result; i += block_size, block++)
+        {
+            uint32_t block_length = header.flash_content_length - i < block_size ?
+                                    header.flash_content_length - i : block_size;
+
+            if(interrupted)
+            {
+                fprintf(stderr, "\nInterrupted\n");
+                result = false;
+                break;
+            }
+
+            uint32_t flash_crc32;
+            if(get_flash_block_crc32(fd, i, block_length, &flash_crc32, &crc_supported) &&
+               find_stored_chunk(flash_crc32, block_length, &keys[block]))
+            {
+                summary.blocks_stored++;
+            }
+            else
+            {
+                for(uint32_t attempt = 0; !read_flash_data(fd, i, block_length, buffer); attempt++)
+                {
+                    fprintf(stderr, "Failed to read from flash address %06x\n", i);
+                    if(!retry_block(fd, i, attempt, &report))
+                    {
+                        // An archive with a missing block is of no use
+                        add_block(&report.failed, i);
+                        result = false;
+                        break;
+                    }
+                }
+
+                if(result)
+                {
+                    summary.blocks_read++;
+                    result = store_chunk(buffer, block_length, &keys[block], &summary);
+                }
+            }
+
+            if(result)
+            {
+                print_progress("Archiving flash", i + block_length, header.flash_content_length);
+            }
+        }
+
+        printf("\n");
+        print_retry_report(&report);
+
+        if(result)
+        {
+            ManifestHeader manifest = {};
+            memcpy(manifest.signature, MANIFEST_SIGNATURE, sizeof(manifest.signature));
+            manifest.block_size = block_size;
+            manifest.block_count = block_count;
+            manifest.tcrt_header = header;
+
+            char path[PATH_MAX];
+            get_manifest_path(name, path, sizeof(path));
+            result = write_store_file(path, &manifest, sizeof(manifest), keys, block_count * sizeof(ChunkKey));
+        }
+
+        if(result)
+        {
+            printf("Archived %u blocks, %u already stored, %u read, %u new chunks\n",
+                   block_count, summary.blocks_stored, summary.blocks_read, summary.chunks_added);
+        }
+
+        free(keys);
+        free(buffer);
+    }
+
+    close(lock);
+    return result;
+}
+
+// Load a manifest with its chunk keys, free the keys when done
+static bool load_manifest(const char *path, ManifestHeader *manifest, ChunkKey **keys)
+{
+    bool result = false;
+    *keys = NULL;
+
+    int file = open_file((char *)path, O_RDONLY);
+    if(file == -1)
+    {
+        fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if(read_file(file, manifest, sizeof(*manifest)) &&
+       memcmp(manifest->signature, MANIFEST_SIGNATURE, sizeof(manifest->signature)) == 0 &&
+       manifest->block_size != 0 &&
+       manifest->block_count == (manifest->tcrt_header.flash_content_length + manifest->block_size - 1) /
+                                manifest->block_size)
+    {
+        *keys = (ChunkKey *)malloc(manifest->block_count ? manifest->block_count * sizeof(ChunkKey) : 1);
+        result = read_file(file, *keys, manifest->block_count * sizeof(ChunkKey));
+    }
+
+    if(!result)
+    {
+        fprintf(stderr, "Invalid manifest %s\n", path);
+        free(*keys);
+        *keys = NULL;
+    }
+
+    close(file);
+    return result;
+}
+
+static bool restore_tcrt(const char *name, char *out_filename)
+{
+    char path[PATH_MAX];
+    get_manifest_path(name, path, sizeof(path));
+
+    ManifestHeader manifest;
+    ChunkKey *keys;
+    int lock = lock_store(LOCK_SH);
+    if(lock == -1 || !load_manifest(path, &manifest, &keys))
+    {
+        if(lock != -1)
+        {
+            close(lock);
+        }
+
+        return false;
+    }
+
+    bool result = false;
+    int file = open_file(out_filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(file != -1)
+    {
+        uint32_t length = manifest.tcrt_header.flash_content_length;
+        uint8_t *buffer = (uint8_t *)malloc(manifest.block_size);
+        result = write_file(file, &manifest.tcrt_header, sizeof(manifest.tcrt_header));
+
+        for(uint32_t i = 0, block = 0; i < length && result; i += manifest.block_size, block++)
+        {
+            uint32_t block_length = length - i < manifest.block_size ? length - i : manifest.block_size;
+
+            get_chunk_path(&keys[block], path, sizeof(path));
+            int chunk = open_file(path, O_RDONLY);
+
+            result = chunk != -1 && read_file(chunk, buffer, block_length) &&
+                     calculate_crc32(buffer, block_length) == keys[block].crc32;
+            if(chunk != -1)
+            {
+                close(chunk);
+            }
+
+            if(!result)
+            {
+                fprintf(stderr, "Missing or damaged chunk %s\n", path);
+            }
+            else if(!write_file(file, buffer, block_length))
+            {
+                fprintf(stderr, "Failed to write data to file. %s\n", strerror(errno));
+                result = false;
+            }
+        }
+
+        free(buffer);
+        close(file);
+
+        if(result)
+        {
+            printf("Restored %s to %s\n", name, out_filename);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Failed to open %s. %s\n", out_filename, strerror(errno));
+    }
+
+    free(keys);
+    close(lock);
+    return result;
+}
+
+// Remove the chunks that no manifest in the store refers to
+static bool collect_garbage()
+{
+    char pattern[PATH_MAX];
+    glob_t manifests = {}, chunks = {};
+    ChunkKey *live_keys = NULL;
+    size_t live_count = 0;
+    bool result = true;
+
+    int lock = lock_store(LOCK_EX);
+    if(lock == -1)
+    {
+        return false;
+    }
+
+    snprintf(pattern, sizeof(pattern), "%s/" MANIFEST_DIRECTORY "/*", store_path);
+    int glob_result = glob(pattern, 0, NULL, &manifests);
+    result = glob_result == 0 || glob_result == GLOB_NOMATCH;
+
+    for(size_t i = 0; i < manifests.gl_pathc && result; i++)
+    {
+        if(is_temp_file(manifests.gl_pathv[i]))
+        {
+            continue;
+        }
+
+        ManifestHeader manifest;
+        ChunkKey *keys;
+
+        // Better keep everything than lose chunks of a manifest we cannot read
+        result = load_manifest(manifests.gl_pathv[i], &manifest, &keys);
+        if(result)
+        {
+            live_keys = (ChunkKey *)realloc(live_keys, (live_count + manifest.block_count + 1) * sizeof(ChunkKey));
+            memcpy(live_keys + live_count, keys, manifest.block_count * sizeof(ChunkKey));
+            live_count += manifest.block_count;
+            free(keys);
+        }
+    }
+
+    if(result)
+    {
+        qsort(live_keys, live_count, sizeof(ChunkKey), compare_chunk_keys);
+
+        snprintf(pattern, sizeof(pattern), "%s/[0-9a-f][0-9a-f]/*", store_path);
+        glob(pattern, 0, NULL, &chunks);
+
+        uint32_t removed = 0;
+        uint64_t removed_bytes = 0;
+
+        for(size_t i = 0; i < chunks.gl_pathc; i++)
+        {
+            ChunkKey key;
+            const char *name = strrchr(chunks.gl_pathv[i], '/') + 1;
+            size_t name_length = strlen(name);
+            struct stat chunk_stat;
+
+            // Only chunks and their temporary files, the latter are left
+            // over from an interrupted archive as none can run now
+            if(!parse_chunk_name(name, &key) ||
+               (name_length != CHUNK_NAME_LENGTH &&
+                (name_length != CHUNK_NAME_LENGTH + strlen(TEMP_SUFFIX) || !is_temp_file(name))))
+            {
+                continue;
+            }
+
+            if(name_length == CHUNK_NAME_LENGTH && live_count &&
+               bsearch(&key, live_keys, live_count, sizeof(ChunkKey), compare_chunk_keys))
+            {
+                continue;
+            }
+
+            if(stat(chunks.gl_pathv[i], &chunk_stat) == 0 && unlink(chunks.gl_pathv[i]) == 0)
+            {
+                removed++;
+                removed_bytes += chunk_stat.st_size;
+            }
+            else
+            {
+                fprintf(stderr, "Failed to remove %s. %s\n", chunks.gl_pathv[i], strerror(errno));
+                result = false;
+            }
+        }
+
+        printf("Removed %u unused chunks (%llu bytes), %zu blocks referenced by %zu manifests\n",
+               removed, (unsigned long long)removed_bytes, live_count, manifests.gl_pathc);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to read manifests in %s, nothing removed\n", store_path);
+    }
+
+    globfree(&chunks);
+    globfree(&manifests);
+    free(live_keys);
+    close(lock);
+
+    return result;
+}
@@ -1,5 +1,24 @@
 #include "commands.h"
 
+#define MAX_STALE_BYTES 1024    // Unexpected bytes to skip before giving up on a response
+#define COMMAND_TIMEOUT_MS 1000 // Allowance for any command round trip
+#define RESYNC_QUIET_MS 100     // Line must be idle this long before resyncing
+#define RESYNC_ATTEMPTS 3
+
+static thread_local CommandResult last_command_result = CommandResult_Ok;
+
+// Called when a command exchange completes or fails, e.g. to collect round trip times
+typedef void (*CommandObserver)(CommandGroup group, uint8_t command, uint64_t round_trip_us, bool result);
+static CommandObserver command_observer = NULL;
+static thread_local uint64_t command_start_us;
+
+// Payload bytes sent per ENQ handshake, negotiated with ReadRxWindow
+static thread_local uint16_t handshake_window = DEFAULT_HANDSHAKE_WINDOW;
+
+// Cleared when the sketch answers CommandResult_NotImplemented
+static thread_local bool fast_read_flash_supported = true;
+static thread_local bool fast_write_flash_supported = true;
+
 static bool receive_debug_output(int fd)
 {
     bool result = false;
@@ -8,8 +27,9 @@ static bool receive_debug_output(int fd)
     while(read_bytes(fd, &rx, 1))
     {
         result = true;
+        stats.debug_bytes++;
 
-        fprintf(stderr, "%c", rx);
+        print_link_message(stderr, "%c", rx);
         if(rx == '\n')
         {
             break;
@@ -19,20 +39,184 @@ static bool receive_debug_output(int fd)
     return result;
 }
 
-static bool receive_command(int fd, CommandGroup group, uint8_t send_command, void *data = NULL, size_t max_data_size = 0)
+static const char *get_command_name(CommandGroup group, uint8_t command)
+{
+    if(group == CommandGroup_Arduino)
+    {
+        switch(command)
+        {
+            case ArduinoCommand_Version:            return "Version";
+            case ArduinoCommand_StartCommandMode:   return "StartCommandMode";
+            case ArduinoCommand_ReadRxWindow:       return "ReadRxWindow";
+            default:                                return "Arduino?";
+        }
+    }
+
+    switch(command)
+    {
+        case TapecartCommand_Exit:              return "Exit";
+        case TapecartCommand_ReadDeviceinfo:    return "ReadDeviceinfo";
+        case TapecartCommand_ReadDevicesizes:   return "ReadDevicesizes";
+        case TapecartCommand_ReadCapabilities:  return "ReadCapabilities";
+        case TapecartCommand_ReadFlash:         return "ReadFlash";
+        case TapecartCommand_ReadFlashFast:     return "ReadFlashFast";
+        case TapecartCommand_WriteFlash:        return "WriteFlash";
+        case TapecartCommand_WriteFlashFast:    return "WriteFlashFast";
+        case TapecartCommand_EraseFlash64K:     return "EraseFlash64K";
+        case TapecartCommand_EraseFlashBlock:   return "EraseFlashBlock";
+        case TapecartCommand_Crc32Flash:        return "Crc32Flash";
+        case TapecartCommand_ReadLoader:        return "ReadLoader";
+        case TapecartCommand_ReadLoadinfo:      return "ReadLoadinfo";
+        case TapecartCommand_WriteLoader:       return "WriteLoader";
+        case TapecartCommand_WriteLoadinfo:     return "WriteLoadinfo";
+        case TapecartCommand_LedOff:            return "LedOff";
+        case TapecartCommand_LedOn:             return "LedOn";
+        case TapecartCommand_ReadDebugflags:    return "ReadDebugflags";
+        case TapecartCommand_WriteDebugflags:   return "WriteDebugflags";
+        case TapecartCommand_DirSetparams:      return "DirSetparams";
+        case TapecartCommand_DirLookup:         return "DirLookup";
+        default:                                return "Tapecart?";
+    }
+}
+
+static uint8_t calculate_checksum(uint8_t checksum, void *data, size_t size)
+{
+    uint8_t *bytes = (uint8_t *)data;
+
+    for(size_t i = 0; i < size; i++)
+    {
+        checksum ^= bytes[i];
+    }
+
+    return checksum;
+}
+
+// Read and drop a response that does not belong to the current command.
+// Returns false if the frame turns out not to be a valid response.
+static bool skip_stale_frame(int fd, ReceiveCommandHeader *header)
+{
+    uint8_t checksum = calculate_checksum(0, &header->group, sizeof(*header) - 1);
+    size_t size = header->length + 1;   // Including checksum
+
+    uint8_t buffer[64];
+    while(size > 0)
+    {
+        size_t chunk_size = size > sizeof(buffer) ? sizeof(buffer) : size;
+        if(!read_bytes(fd, buffer, chunk_size))
+        {
+            return false;
+        }
+
+        checksum = calculate_checksum(checksum, buffer, chunk_size);
+        size -= chunk_size;
+    }
+
+    return checksum == 0;
+}
+
+// Deadline for a whole command exchange, sized to the work the device has to do
+static uint32_t get_command_timeout(CommandGroup group, uint8_t command, void *data, size_t data_size)
+{
+    uint32_t timeout = COMMAND_TIMEOUT_MS + get_serial_transfer_ms(sizeof(SendCommandHeader) + data_size + 1);
+
+    if(group == CommandGroup_Arduino)
+    {
+        if(command == ArduinoCommand_StartCommandMode)
+        {
+            timeout += 2000;    // Tapecart has to enter command mode
+        }
+
+        return timeout;
+    }
+
+    switch(command)
+    {
+        case TapecartCommand_ReadFlash:
+        case TapecartCommand_ReadFlashFast:
+            timeout += get_serial_transfer_ms(((ReadFlash *)data)->length);
+            break;
+
+        case TapecartCommand_WriteFlash:
+        case TapecartCommand_WriteFlashFast:
+            timeout += (data_size / 0x100 + 1) * 10;    // Page program time
+            break;
+
+        case TapecartCommand_EraseFlashBlock:
+            timeout += 1000;
+            break;
+
+        case TapecartCommand_EraseFlash64K:
+            timeout += 3000;
+            break;
+
+        case TapecartCommand_Crc32Flash:
+            timeout += ((ReadCrc32Flash *)data)->length / 1024 * 20;
+            break;
+
+        default:
+            break;
+    }
+
+    return timeout;
+}
+
+static void notify_command_observer(CommandGroup group, uint8_t command, bool result)
+{
+    if(command_observer)
+    {
+        command_observer(group, command, get_time_us() - command_start_us, result);
+    }
+}
+
+static bool receive_response(int fd, CommandGroup group, uint8_t send_command, void *data, size_t max_data_size)
 {
     ReceiveCommandHeader header = {};
+    last_command_result = CommandResult_Error;
+
+    bool in_sync = true;
+    size_t stale_bytes = 0;
+    errno = 0;
 
-    while(read_bytes(fd, &header, sizeof(header)))
+    // Scan for the start of the response, skipping anything left over from
+    // an earlier exchange. The stream is only flushed when we lose sync.
+    while(read_bytes(fd, &header.prefix, 1))
     {
         if(header.prefix == CommandPrefix_Debug)
         {
             // Print debug output from arduino
-            fprintf(stderr, "%.*s", (int)sizeof(header), (uint8_t *)&header);
+            print_link_message(stderr, "*");
             receive_debug_output(fd);
         }
-        else if(header.prefix == CommandPrefix_SOH)
+        else if(header.prefix != CommandPrefix_SOH)
+        {
+            if(++stale_bytes > MAX_STALE_BYTES)
+            {
+                print_link_message(stderr, "No response received, discarded %u unexpected bytes\n", (int)stale_bytes);
+                in_sync = false;
+                break;
+            }
+        }
+        else if(!read_bytes(fd, &header.group, sizeof(header) - 1))
+        {
+            print_link_message(stderr, "Failed to read command header\n");
+            in_sync = false;
+            break;
+        }
+        else if(header.group != group || header.command != send_command)
         {
+            if(!skip_stale_frame(fd, &header))
+            {
+                stats.checksum_errors++;
+                print_link_message(stderr, "Invalid response received for command %u, expected %u\n",
+                        header.command, send_command);
+                in_sync = false;
+                break;
+            }
+        }
+        else
+        {
+            in_sync = false;
+
             if(header.length <= max_data_size)
             {
                 uint8_t *buffer = (uint8_t *)data;
@@ -40,153 +224,182 @@ static bool receive_command(int fd, CommandGroup group, uint8_t send_command, vo
                 {
                     uint8_t checksum = 0;
                     if(read_bytes(fd, &checksum, 1))
-                    {           
-                        uint8_t calc_checksum = 0;
-                        uint8_t *header_data = (uint8_t *)&header;
-
-                        for(size_t i = 1; i < sizeof(header); i++)
-                        {
-                            calc_checksum ^= header_data[i];
-                        }
-                        for(size_t i = 0; i < header.length; i++)
-                        {
-                            calc_checksum ^= buffer[i];
-                        }
+                    {
+                        uint8_t calc_checksum = calculate_checksum(0, &header.group, sizeof(header) - 1);
+                        calc_checksum = calculate_checksum(calc_checksum, buffer, header.length);
 
                         if(calc_checksum == checksum)
                         {
-                            if(header.group == group)
+                            in_sync = true;
+                            last_command_result = header.result;
+
+                            if(header.result == CommandResult_Ok)
                             {
-                                if(header.command == send_command)
-                                {
-                                    if(header.result == 0)
-                                    {
-                                        return true;
-                                    }
-                                    else if(header.result != 1)
-                                    {
-                                        fprintf(stderr, "Command failed with result 0x%02X\n", header.result);
-                                    }
-                                }
-                                else
-                                {
-                                    fprintf(stderr, "Invalid command received %u, expected %u\n",
-                                            header.command, send_command);
-                                }
+                                return true;
                             }
-                            else
+                            else if(header.result != CommandResult_Error &&
+                                    header.result != CommandResult_NotImplemented)
                             {
-                                fprintf(stderr, "Invalid command group received %u, expected %u\n",
-                                        header.group, group);
+                                print_link_message(stderr, "Command failed with result 0x%02X\n", header.result);
                             }
                         }
                         else
                         {
-                            fprintf(stderr, "Invalid checksum %02x for received command, expected %02x\n", calc_checksum, checksum);
+                            print_link_message(stderr, "Invalid checksum %02x for received command, expected %02x\n", calc_checksum, checksum);
+                            stats.checksum_errors++;
                         }
                     }
                     else
                     {
-                        fprintf(stderr, "Failed to read checksum\n");
+                        print_link_message(stderr, "Failed to read checksum\n");
                     }
                 }
                 else
                 {
-                    fprintf(stderr, "Failed to read command data\n");
+                    print_link_message(stderr, "Failed to read command data\n");
                 }
             }
             else
             {
-                fprintf(stderr, "Invalid command length received %u, expected max %u bytes\n",
+                print_link_message(stderr, "Invalid command length received %u, expected max %u bytes\n",
                         header.length, (int)max_data_size);
             }
 
             break;
         }
+    }
+
+    if(errno == ETIMEDOUT)
+    {
+        print_link_message(stderr, "Timeout waiting for response to command 0x%02X\n", send_command);
+        in_sync = false;
+    }
+
+    if(!in_sync)
+    {
+        discard_rx_buffer(fd);
+    }
+
+    return false;
+}
+
+static bool receive_command(int fd, CommandGroup group, uint8_t send_command, void *data = NULL, size_t max_data_size = 0)
+{
+    bool result = receive_response(fd, group, send_command, data, max_data_size);
+    notify_command_observer(group, send_command, result);
+
+    return result;
+}
+
+static bool receive_handshake(int fd)
+{
+    uint8_t rx;
+
+    while(read_bytes(fd, &rx, 1))
+    {
+        if(rx == CommandPrefix_Debug)
+        {
+            // Print debug output from arduino
+            print_link_message(stderr, "*");
+            receive_debug_output(fd);
+        }
+        else if(rx == CommandPrefix_ENQ)
+        {
+            return true;
+        }
         else
         {
-            fprintf(stderr, "Invalid command received 0x%02X\n", header.prefix);
-            break;
+            print_link_message(stderr, "Invalid handshake received 0x%02X\n", rx);
+            discard_rx_buffer(fd);
+            return false;
         }
     }
 
+    if(errno == ETIMEDOUT)
+    {
+        print_link_message(stderr, "Timeout waiting for handshake\n");
+    }
+
     return false;
 }
 
-
-static bool send_command(int fd, CommandGroup group, uint8_t send_command, void *data = NULL, size_t data_size = 0)
+// The command data is sent as a parameter block followed by an optional
+// payload, so bulk data goes out straight from the caller's buffer
+static bool send_command(int fd, CommandGroup group, uint8_t send_command, void *data = NULL, size_t data_size = 0,
+                         void *payload = NULL, size_t payload_size = 0)
 {
+    size_t total_size = data_size + payload_size;
     SendCommandHeader header =
     {
         CommandPrefix_SOH,
         group,
         send_command,
-        (uint16_t)data_size
+        (uint16_t)total_size
     };
 
-    uint8_t checksum = 0;
-    uint8_t *header_data = (uint8_t *)&header;
-    uint8_t *data_location = (uint8_t *)data;
+    uint8_t checksum = calculate_checksum(0, &header.group, sizeof(header) - 1);
+    checksum = calculate_checksum(checksum, data, data_size);
+    checksum = calculate_checksum(checksum, payload, payload_size);
 
-    for(size_t i = 1; i < sizeof(header); i++)
-    {
-        checksum ^= header_data[i];
-    }
-    for(size_t i = 0; i < data_size; i++)
-    {
-        checksum ^= data_location[i];
-    }
+    bool result = true;
+    command_start_us = get_time_us();
+    set_serial_deadline(get_command_timeout(group, send_command, data, total_size));
 
-    bool result = false;
-    discard_rx_buffer(fd);
+    // Each handshake window goes out with a single writev(): the header with
+    // the first window, then the parameter block and payload slices, and the
+    // checksum when no further handshake is expected
+    bool waitForHandshake = total_size > handshake_window;
+    size_t offset = 0;
 
-    if(send_bytes(fd, &header, sizeof(header)))
+    do
     {
-        result = true;
-        bool waitForHandshake = data_size > 32;
+        struct iovec iov[4];
+        int count = 0;
+        size_t chunk_end = total_size - offset > handshake_window ? offset + handshake_window : total_size;
 
-        while(data_size > 0 && result)
+        if(offset == 0)
         {
-            size_t data_size_to_send = data_size > 32 ? 32 : data_size;
-            if(send_bytes(fd, data_location, data_size_to_send))
-            {
-                data_location += data_size_to_send;
-                data_size -= data_size_to_send;
+            iov[count++] = { &header, sizeof(header) };
+        }
 
-                if(waitForHandshake)
-                {
-                    uint8_t rx;
-                    while(read_bytes(fd, &rx, 1))
-                    {
-                        if(rx == CommandPrefix_Debug)
-                        {
-                            // Print debug output from arduino
-                            fprintf(stderr, "*");
-                            receive_debug_output(fd);
-                        }
-                        else if(rx == CommandPrefix_ENQ)
-                        {
-                            break;
-                        }
-                        else
-                        {
-                            result = false;
-                            break;
-                        }
-                    }
-                }
-            }
-            else
-            {
-                result = false;
-            }
+        // A window may start in the parameter block and end in the payload
+        if(offset < data_size)
+        {
+            size_t end = chunk_end < data_size ? chunk_end : data_size;
+            iov[count++] = { (uint8_t *)data + offset, end - offset };
+            offset = end;
         }
 
-        if(result)
+        if(offset < chunk_end)
         {
-            result = send_bytes(fd, &checksum, sizeof(checksum));
+            iov[count++] = { (uint8_t *)payload + offset - data_size, chunk_end - offset };
+            offset = chunk_end;
+        }
+
+        if(offset == total_size && !waitForHandshake)
+        {
+            iov[count++] = { &checksum, sizeof(checksum) };
+        }
+
+        result = send_iovec(fd, iov, count);
+
+        if(result && waitForHandshake)
+        {
+            result = receive_handshake(fd);
         }
     }
+    while(offset < total_size && result);
+
+    // The sketch acknowledges the last window before it takes the checksum
+    if(result && waitForHandshake)
+    {
+        result = send_bytes(fd, &checksum, sizeof(checksum));
+    }
+
+    if(!result)
+    {
+        notify_command_observer(group, send_command, false);
+    }
 
     return result;
 }
@@ -231,6 +444,70 @@ static bool get_sketch_version(int fd, ArduinoSketchVersion *version)
     return send_arduino_command(fd, ArduinoCommand_Version, version, sizeof(ArduinoSketchVersion));
 }
 
+// Send as much payload per handshake as the sketch can buffer. Sketches
+// before RX_WINDOW_API_VERSION, or ones that fail to answer, keep the 32 byte
+// window.
+static void negotiate_handshake_window(int fd, ArduinoSketchVersion *version)
+{
+    RxWindow rx_window;
+    handshake_window = DEFAULT_HANDSHAKE_WINDOW;
+
+    if(version->api_version >= RX_WINDOW_API_VERSION &&
+       send_arduino_command(fd, ArduinoCommand_ReadRxWindow, &rx_window, sizeof(rx_window)) &&
+       rx_window.size > DEFAULT_HANDSHAKE_WINDOW)
+    {
+        handshake_window = rx_window.size;
+    }
+}
+
+// Ask the sketch to switch to rate. It answers at the old rate and sets
+// *accepted_rate to the rate it switches to, 0 if it does not support it.
+// The host has to follow within BAUD_RATE_CONFIRM_MS, or the sketch goes
+// back to the old rate.
+static bool set_sketch_baud_rate(int fd, uint32_t rate, uint32_t *accepted_rate)
+{
+    BaudRate baud_rate = { rate };
+
+    if(send_command(fd, CommandGroup_Arduino, ArduinoCommand_SetBaudRate, &baud_rate, sizeof(baud_rate)) &&
+       receive_command(fd, CommandGroup_Arduino, ArduinoCommand_SetBaudRate, &baud_rate, sizeof(baud_rate)))
+    {
+        *accepted_rate = baud_rate.rate;
+        return true;
+    }
+
+    return false;
+}
+
+// Bring the link back to a known state after a failed exchange. Waits for
+// the line to go quiet, drops anything received and checks that the sketch
+// answers again. A half received command on the Arduino side is flushed by
+// the first ping failing.
+static bool resync_link(int fd)
+{
+    char rx;
+    size_t stale_bytes = 0;
+
+    set_serial_deadline(RESYNC_QUIET_MS);
+    while(read_bytes(fd, &rx, 1) && ++stale_bytes < MAX_STALE_BYTES)
+    {
+        set_serial_deadline(RESYNC_QUIET_MS);
+    }
+
+    for(int i = 0; i < RESYNC_ATTEMPTS; i++)
+    {
+        discard_rx_buffer(fd);
+
+        ArduinoSketchVersion version;
+        if(get_sketch_version(fd, &version))
+        {
+            return true;
+        }
+    }
+
+    print_link_message(stderr, "Failed to resync with Arduino\n");
+    return false;
+}
+
 static bool get_device_info(int fd, DeviceInfo *info)
 {
     memset(info, 0, sizeof(DeviceInfo));    // NOTE: Make sure that string is null-terminated
@@ -286,6 +563,135 @@ static bool write_flash(int fd, WriteFlash *write_flash)
     return send_tapecart_write_command(fd, TapecartCommand_WriteFlash, write_flash, sizeof(*write_flash));
 }
 
+static bool read_flash_fast(int fd, uint32_t start_address, uint16_t length, void *rx_data)
+{
+    assert(start_address <= 0xFFFFFF);
+    assert(length <= FAST_FLASH_MAX_LENGTH);
+
+    ReadFlash read_flash
+    {
+        start_address,
+        length
+    };
+
+    if(send_command(fd, CommandGroup_Tapecart, TapecartCommand_ReadFlashFast, &read_flash, sizeof(read_flash)))
+    {
+        return receive_command(fd, CommandGroup_Tapecart, TapecartCommand_ReadFlashFast, rx_data, length);
+    }
+
+    return false;
+}
+
+// The data is sent from where it is, e.g. the mapped TCRT image
+static bool write_flash_fast(int fd, uint32_t start_address, uint16_t length, void *data)
+{
+    assert(start_address <= 0xFFFFFF);
+    assert(length <= FAST_FLASH_MAX_LENGTH);
+
+    WriteFlashFast write_flash;
+    write_flash.start_address = start_address;
+    write_flash.length = length;
+
+    if(send_command(fd, CommandGroup_Tapecart, TapecartCommand_WriteFlashFast,
+                    &write_flash, offsetof(WriteFlashFast, data), data, length))
+    {
+        return receive_command(fd, CommandGroup_Tapecart, TapecartCommand_WriteFlashFast);
+    }
+
+    return false;
+}
+
+// Read any amount of flash, using ReadFlashFast when the sketch supports it
+static bool read_flash_data(int fd, uint32_t start_address, uint32_t length, void *rx_data)
+{
+    uint8_t *buffer = (uint8_t *)rx_data;
+
+    while(length > 0)
+    {
+        if(fast_read_flash_supported)
+        {
+            uint16_t size = length > FAST_FLASH_MAX_LENGTH ? FAST_FLASH_MAX_LENGTH : length;
+            if(!read_flash_fast(fd, start_address, size, buffer))
+            {
+                if(last_command_result != CommandResult_NotImplemented)
+                {
+                    return false;
+                }
+
+                fast_read_flash_supported = false;
+                continue;
+            }
+
+            start_address += size;
+            buffer += size;
+            length -= size;
+        }
+        else
+        {
+            uint16_t size = length > 0x100 ? 0x100 : length;
+            if(!read_flash(fd, start_address, size, buffer))
+            {
+                return false;
+            }
+
+            start_address += size;
+            buffer += size;
+            length -= size;
+        }
+    }
+
+    return true;
+}
+
+// Write any amount of flash, using WriteFlashFast when the sketch supports it
+static bool write_flash_data(int fd, uint32_t start_address, uint32_t length, void *data)
+{
+    uint8_t *buffer = (uint8_t *)data;
+
+    while(length > 0)
+    {
+        if(fast_write_flash_supported)
+        {
+            uint16_t size = length > FAST_FLASH_MAX_LENGTH ? FAST_FLASH_MAX_LENGTH : length;
+            if(!write_flash_fast(fd, start_address, size, buffer))
+            {
+                if(last_command_result != CommandResult_NotImplemented)
+                {
+                    return false;
+                }
+
+                fast_write_flash_supported = false;
+                continue;
+            }
+
+            start_address += size;
+            buffer += size;
+            length -= size;
+        }
+        else
+        {
+            WriteFlash write_flash_data;
+            uint16_t size = length > sizeof(write_flash_data.data) ? sizeof(write_flash_data.data) : length;
+
+            write_flash_data.start_address = start_address;
+            write_flash_data.length = sizeof(write_flash_data.data);
+            memset(write_flash_data.data, 0xFF, sizeof(write_flash_data.data));
+            memcpy(write_flash_data.data, buffer, size);
+
+            if(!write_flash(fd, &write_flash_data))
+            {
+                return false;
+            }
+
+            start_address += size;
+            buffer += size;
+            length -= size;
+        }
+    }
+
+    return true;
+}
+
 static bool erase_flash_block(int fd, uint32_t start_address)
 {
     assert(start_address <= 0xFFFFFF);
@@ -298,6 +704,19 @@ static bool erase_flash_block(int fd, uint32_t start_address)
     return send_tapecart_write_command(fd, TapecartCommand_EraseFlashBlock, &erase_flash, sizeof(erase_flash));
 }
 
+static bool erase_flash_64k(int fd, uint32_t start_address)
+{
+    assert(start_address <= 0xFFFFFF);
+    assert((start_address % 0x10000) == 0);
+
+    EraseFlash erase_flash
+    {
+        start_address
+    };
+
+    return send_tapecart_write_command(fd, TapecartCommand_EraseFlash64K, &erase_flash, sizeof(erase_flash));
+}
+
 static bool crc32_flash(int fd, uint32_t start_address, uint32_t length, uint32_t *crc)
 {
     assert(start_address <= 0xFFFFFF);
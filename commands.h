@@ -1,4 +1,10 @@
-#define SUPPORTED_API_VERSION 2
+#define SUPPORTED_API_VERSION 3
+#define OLDEST_API_VERSION 2
+#define RX_WINDOW_API_VERSION 3         // Sketch reports its receive window, see ReadRxWindow
+#define BAUD_RATE_API_VERSION 3         // Sketch can switch its serial speed, see SetBaudRate
+#define BAUD_RATE_CONFIRM_MS 500        // Sketch goes back to the old rate without a command at the new one
+#define DEFAULT_HANDSHAKE_WINDOW 32     // Payload bytes per ENQ handshake of older sketches
+#define FAST_FLASH_MAX_LENGTH 0x1000    // Max data per ReadFlashFast/WriteFlashFast command
 
 enum CommandPrefix : uint8_t
 {
@@ -16,7 +22,9 @@ enum CommandGroup : uint8_t
 enum ArduinoCommand : uint8_t
 {
     ArduinoCommand_Version = 0x01,
-    ArduinoCommand_StartCommandMode = 0x02
+    ArduinoCommand_StartCommandMode = 0x02,
+    ArduinoCommand_ReadRxWindow = 0x03,
+    ArduinoCommand_SetBaudRate = 0x04
 };
 
 enum TapecartCommand : uint8_t
@@ -99,6 +107,19 @@ struct ArduinoSketchVersion
     ArduinoType arduino_type;
 };
 
+// Payload bytes the sketch can take before it has to send an ENQ
+struct RxWindow
+{
+    uint16_t size;
+};
+
+// Sent with the requested rate. The answer, still at the old rate, carries
+// the rate the sketch switches to, 0 if it stays.
+struct BaudRate
+{
+    uint32_t rate;
+};
+
 struct DeviceInfo
 {
     char str[33];   // NOTE: 32 characters + null-terminator
@@ -142,6 +163,13 @@ struct WriteFlash
     uint8_t data[0x100];
 };
 
+struct WriteFlashFast
+{
+    uint32_t start_address : 24;
+    uint16_t length;
+    uint8_t data[FAST_FLASH_MAX_LENGTH];    // NOTE: Only length bytes are sent
+};
+
 struct ReadCrc32Flash
 {
     uint32_t start_address : 24;
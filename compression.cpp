@@ -0,0 +1,288 @@
+// Block compression for TCRT images. The flash content is cut into 4K blocks
+// that are packed independently, so any block can be unpacked on its own.
+// Each packed block starts with a 16 bit size word:
+//
+//     0                   the block is blank, all 0xFF
+//     PACKED_BLOCK_RAW|n  n bytes stored as they are
+//     n                   n bytes of LZ sequences
+//
+// The LZ sequences use the LZ4 block layout. A token holds the literal count
+// in the high and the match length minus 4 in the low nibble, 15 means more
+// length bytes follow. Then come the literals and a 16 bit match offset. The
+// last sequence has literals only.
+
+#define COMPRESSED_BLOCK_SIZE 0x1000
+#define PACKED_BLOCK_RAW 0x8000
+#define PACKED_BLOCK_MAX_SIZE (sizeof(uint16_t) + COMPRESSED_BLOCK_SIZE)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static uint32_t read_uint32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static bool put_lz_length(uint8_t **out, uint8_t *out_end, uint32_t length)
+{
+    for(; length >= 0xFF; length -= 0xFF)
+    {
+        if(*out >= out_end)
+        {
+            return false;
+        }
+
+        *(*out)++ = 0xFF;
+    }
+
+    if(*out >= out_end)
+    {
+        return false;
+    }
+
+    *(*out)++ = length;
+    return true;
+}
+
+static bool put_lz_sequence(uint8_t **out, uint8_t *out_end, const uint8_t *literals, uint32_t literal_count,
+                            uint32_t offset, uint32_t match_length)
+{
+    uint32_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    if(*out >= out_end)
+    {
+        return false;
+    }
+
+    *(*out)++ = (literal_count < 15 ? literal_count : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+    if((literal_count >= 15 && !put_lz_length(out, out_end, literal_count - 15)) ||
+       out_end - *out < literal_count)
+    {
+        return false;
+    }
+
+    memcpy(*out, literals, literal_count);
+    *out += literal_count;
+
+    if(match_length)
+    {
+        if(out_end - *out < 2)
+        {
+            return false;
+        }
+
+        *(*out)++ = offset & 0xFF;
+        *(*out)++ = offset >> 8;
+
+        if(match_code >= 15 && !put_lz_length(out, out_end, match_code - 15))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Returns the compressed size, or 0 if it does not fit into out_size
+static size_t lz_compress(const uint8_t *data, size_t size, uint8_t *out, size_t out_size)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    const uint8_t *input = data, *anchor = data, *end = data + size;
+    uint8_t *output = out, *out_end = out + out_size;
+
+    while(end - input >= LZ_MIN_MATCH)
+    {
+        uint32_t sequence = read_uint32(input);
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        uint16_t candidate = table[hash];
+        table[hash] = input - data;
+
+        if(candidate == 0xFFFF || read_uint32(data + candidate) != sequence)
+        {
+            input++;
+            continue;
+        }
+
+        const uint8_t *match = data + candidate;
+        uint32_t match_length = LZ_MIN_MATCH;
+        while(input + match_length < end && match[match_length] == input[match_length])
+        {
+            match_length++;
+        }
+
+        if(!put_lz_sequence(&output, out_end, anchor, input - anchor, input - match, match_length))
+        {
+            return 0;
+        }
+
+        input += match_length;
+        anchor = input;
+    }
+
+    if(!put_lz_sequence(&output, out_end, anchor, end - anchor, 0, 0))
+    {
+        return 0;
+    }
+
+    return output - out;
+}
+
+static bool get_lz_length(const uint8_t **input, const uint8_t *end, uint32_t *length)
+{
+    uint8_t value;
+
+    do
+    {
+        if(*input >= end)
+        {
+            return false;
+        }
+
+        value = *(*input)++;
+        *length += value;
+    }
+    while(value == 0xFF);
+
+    return true;
+}
+
+// Returns true if the data unpacks to exactly out_size bytes
+static bool lz_decompress(const uint8_t *data, size_t size, uint8_t *out, size_t out_size)
+{
+    const uint8_t *input = data, *end = data + size;
+    uint8_t *output = out, *out_end = out + out_size;
+
+    while(input < end)
+    {
+        uint8_t token = *input++;
+        uint32_t literal_count = token >> 4;
+
+        if((literal_count == 15 && !get_lz_length(&input, end, &literal_count)) ||
+           end - input < literal_count || out_end - output < literal_count)
+        {
+            return false;
+        }
+
+        memcpy(output, input, literal_count);
+        input += literal_count;
+        output += literal_count;
+
+        if(input == end)
+        {
+            break;
+        }
+
+        if(end - input < 2)
+        {
+            return false;
+        }
+
+        uint32_t offset = input[0] | input[1] << 8;
+        uint32_t match_length = token & 0x0F;
+        input += 2;
+
+        if((match_length == 15 && !get_lz_length(&input, end, &match_length)) ||
+           offset == 0 || offset > output - out)
+        {
+            return false;
+        }
+
+        match_length += LZ_MIN_MATCH;
+        if(out_end - output < match_length)
+        {
+            return false;
+        }
+
+        // Byte by byte, the match may overlap what it produces
+        const uint8_t *match = output - offset;
+        for(uint32_t i = 0; i < match_length; i++)
+        {
+            output[i] = match[i];
+        }
+
+        output += match_length;
+    }
+
+    return output == out_end;
+}
+
+// Pack a block of up to COMPRESSED_BLOCK_SIZE bytes into out, which has to
+// hold PACKED_BLOCK_MAX_SIZE bytes. Returns the packed size.
+static size_t pack_block(const uint8_t *data, uint32_t size, uint8_t *out)
+{
+    assert(size <= COMPRESSED_BLOCK_SIZE);
+
+    uint16_t size_word = 0;
+    size_t packed_size = 0;
+
+    bool blank = true;
+    for(uint32_t i = 0; i < size && blank; i++)
+    {
+        blank = data[i] == 0xFF;
+    }
+
+    if(!blank)
+    {
+        packed_size = lz_compress(data, size, out + sizeof(size_word), size - 1);
+        if(packed_size)
+        {
+            size_word = packed_size;
+        }
+        else
+        {
+            memcpy(out + sizeof(size_word), data, size);
+            packed_size = size;
+            size_word = PACKED_BLOCK_RAW | size;
+        }
+    }
+
+    memcpy(out, &size_word, sizeof(size_word));
+    return sizeof(size_word) + packed_size;
+}
+
+// Size of the packed block at data, or 0 if it runs past end
+static size_t get_packed_block_size(const uint8_t *data, const uint8_t *end)
+{
+    uint16_t size_word;
+
+    if(end - data < (ptrdiff_t)sizeof(size_word))
+    {
+        return 0;
+    }
+
+    memcpy(&size_word, data, sizeof(size_word));
+    size_t packed_size = sizeof(size_word) + (size_word & ~PACKED_BLOCK_RAW);
+
+    return end - data < (ptrdiff_t)packed_size ? 0 : packed_size;
+}
+
+// Unpack a block of size bytes from the packed block at data
+static bool unpack_block(const uint8_t *data, size_t packed_size, uint8_t *out, uint32_t size)
+{
+    uint16_t size_word;
+    memcpy(&size_word, data, sizeof(size_word));
+    data += sizeof(size_word);
+
+    if(size_word == 0)
+    {
+        memset(out, 0xFF, size);
+        return true;
+    }
+
+    if(size_word & PACKED_BLOCK_RAW)
+    {
+        if((size_word & ~PACKED_BLOCK_RAW) != size)
+        {
+            return false;
+        }
+
+        memcpy(out, data, size);
+        return true;
+    }
+
+    return lz_decompress(data, packed_size - sizeof(size_word), out, size);
+}
@@ -0,0 +1,288 @@
+// CRC-32 (reflected polynomial 0xEDB88320) as computed by the Crc32Flash command.
+// The update functions work on the internal state, i.e. before the final inversion.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_X86_CLMUL
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#define CRC32_ARMV8
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+typedef uint32_t (*Crc32Update)(uint32_t crc, const uint8_t *data, size_t size);
+
+struct Crc32Tables
+{
+    uint32_t slice[8][256];     // Slicing-by-8 lookup tables
+    uint32_t x2n[32];           // x^(2^n) mod P(x), used by crc32_combine
+
+    Crc32Tables();
+};
+
+// Adapted from crc32b - http://www.hackersdelight.org/hdcodetxt/crc.c.txt
+static uint32_t crc32_update_bitwise(uint32_t crc, const uint8_t *data, size_t size)
+{
+   while(size--)
+   {
+      crc ^= *data++;
+      for(uint8_t i=0; i<8; i++)
+      {
+         crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+      }
+   }
+
+   return crc;
+}
+
+// Multiply a and b modulo P(x), both in reflected bit order
+static uint32_t crc32_multiply(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    while(true)
+    {
+        if(a & m)
+        {
+            p ^= b;
+            if((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+    }
+
+    return p;
+}
+
+Crc32Tables::Crc32Tables()
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint8_t byte = i;
+        slice[0][i] = crc32_update_bitwise(0, &byte, 1);
+    }
+
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        for(int k = 1; k < 8; k++)
+        {
+            uint32_t crc = slice[k - 1][i];
+            slice[k][i] = (crc >> 8) ^ slice[0][crc & 0xFF];
+        }
+    }
+
+    uint32_t p = 1u << 30;  // x^1
+    x2n[0] = p;
+    for(int n = 1; n < 32; n++)
+    {
+        x2n[n] = p = crc32_multiply(p, p);
+    }
+}
+
+static const Crc32Tables crc32_tables;
+
+// NOTE: Assume we compile on little endian
+static uint32_t crc32_update_slicing8(uint32_t crc, const uint8_t *data, size_t size)
+{
+    const uint32_t (*t)[256] = crc32_tables.slice;
+
+    while(size >= 8)
+    {
+        uint32_t low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 4, sizeof(high));
+        low ^= crc;
+
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+              t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^
+              t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+
+        data += 8;
+        size -= 8;
+    }
+
+    while(size--)
+    {
+        crc = t[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32_X86_CLMUL
+// Folding with carry-less multiplication, see Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". Constants for the reflected
+// polynomial as used by zlib and the Linux kernel.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_update_clmul(uint32_t crc, const uint8_t *data, size_t size)
+{
+    if(size < 64)
+    {
+        return crc32_update_slicing8(crc, data, size);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    data += 64;
+    size -= 64;
+
+    // Fold 512 bits at a time
+    while(size >= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+
+        data += 64;
+        size -= 64;
+    }
+
+    // Fold into 128 bits
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while(size >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), x5);
+
+        data += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = _mm_extract_epi32(x1, 1);
+    return crc32_update_slicing8(crc, data, size);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+// ARMv8 CRC32 instructions implement this exact polynomial
+static uint32_t crc32_update_armv8(uint32_t crc, const uint8_t *data, size_t size)
+{
+    while(size >= 8)
+    {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        asm(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(value));
+
+        data += 8;
+        size -= 8;
+    }
+
+    while(size--)
+    {
+        uint32_t value = *data++;
+        asm(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"(value));
+    }
+
+    return crc;
+}
+#endif
+
+static Crc32Update select_crc32_update(const char **name)
+{
+#ifdef CRC32_X86_CLMUL
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        *name = "pclmul";
+        return crc32_update_clmul;
+    }
+#endif
+#ifdef CRC32_ARMV8
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        *name = "armv8-crc";
+        return crc32_update_armv8;
+    }
+#endif
+
+    *name = "slicing-by-8";
+    return crc32_update_slicing8;
+}
+
+static const char *crc32_engine_name;
+static const Crc32Update crc32_update = select_crc32_update(&crc32_engine_name);
+
+static uint32_t calculate_crc32(const void *data, size_t size)
+{
+    return ~crc32_update(0xFFFFFFFF, (const uint8_t *)data, size);
+}
+
+// CRC of the concatenation of two blocks, given the CRC of each block and
+// the length of the second one
+__attribute__((unused))
+static uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+    uint32_t p = 1u << 31;  // x^0
+    unsigned k = 3;         // Length is in bytes, x^(8*n) = x^(2^3 * n)
+
+    while(length2)
+    {
+        if(length2 & 1)
+        {
+            p = crc32_multiply(crc32_tables.x2n[k & 31], p);
+        }
+
+        length2 >>= 1;
+        k++;
+    }
+
+    return crc32_multiply(p, crc1) ^ crc2;
+}
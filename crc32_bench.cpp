@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "crc32.cpp"
+
+#define BENCH_BUFFER_SIZE (2*1024*1024)
+#define BENCH_MIN_SECONDS 0.5
+
+static double get_seconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t bench_crc32(const char *name, Crc32Update update, const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0;
+    uint64_t bytes = 0;
+    double start = get_seconds(), elapsed;
+
+    do
+    {
+        crc = ~update(0xFFFFFFFF, data, size);
+        bytes += size;
+        elapsed = get_seconds() - start;
+    }
+    while(elapsed < BENCH_MIN_SECONDS);
+
+    printf("%-14s %10.1f MB/s  crc %08x\n", name, bytes / elapsed / (1024*1024), crc);
+    return crc;
+}
+
+int main()
+{
+    uint8_t *buffer = (uint8_t *)malloc(BENCH_BUFFER_SIZE);
+    srand(1);
+    for(size_t i = 0; i < BENCH_BUFFER_SIZE; i++)
+    {
+        buffer[i] = rand();
+    }
+
+    printf("Selected engine: %s\n", crc32_engine_name);
+
+    uint32_t expected = bench_crc32("bitwise", crc32_update_bitwise, buffer, BENCH_BUFFER_SIZE);
+    bool result = bench_crc32("slicing-by-8", crc32_update_slicing8, buffer, BENCH_BUFFER_SIZE) == expected;
+    result &= bench_crc32(crc32_engine_name, crc32_update, buffer, BENCH_BUFFER_SIZE) == expected;
+
+    // Odd sizes and offsets exercise the head and tail handling
+    for(size_t size = 0; size < 300; size++)
+    {
+        uint32_t crc = ~crc32_update_bitwise(0xFFFFFFFF, buffer + 3, size);
+        result &= calculate_crc32(buffer + 3, size) == crc;
+        result &= ~crc32_update_slicing8(0xFFFFFFFF, buffer + 3, size) == crc;
+    }
+
+    // Merging per-block CRCs must give the CRC of the whole buffer
+    uint32_t combined = 0;
+    for(size_t i = 0; i < BENCH_BUFFER_SIZE; i += 4096)
+    {
+        combined = crc32_combine(combined, calculate_crc32(buffer + i, 4096), 4096);
+    }
+    result &= combined == expected;
+
+    printf("%s\n", result ? "All CRC32 engines agree" : "CRC32 mismatch");
+    free(buffer);
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
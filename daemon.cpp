@@ -0,0 +1,620 @@
+// Daemon mode, one process keeps the port open and the Tapecart in command
+// mode between jobs. Clients connect to a Unix socket and pass their stdout,
+// stderr and working directory along with the job, so the job prints and
+// opens files just as if it ran in the client. The result byte comes back
+// when the job is done.
+//
+// The socket lives in $XDG_RUNTIME_DIR, or else in a directory only the user
+// can enter, /tmp/tapecart_flasher-<uid>. Both ends check that the other one
+// runs as the same user before descriptors or jobs change hands.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DAEMON_SIGNATURE "TCDMN001"
+#define DAEMON_SOCKET_DIR "/tmp/tapecart_flasher-"   // Followed by the uid
+#define DAEMON_REQUEST_FDS 3    // stdout, stderr, working directory
+
+enum DaemonFlags : uint8_t
+{
+    DaemonFlags_None =      0x00,
+    DaemonFlags_Diff =      0x01,
+    DaemonFlags_Verify =    0x02,
+    DaemonFlags_Sparse =    0x04,
+    DaemonFlags_Compress =  0x08,
+    DaemonFlags_Resume =    0x10,
+    DaemonFlags_Stats =     0x20
+};
+
+#pragma pack(push)
+#pragma pack(1)
+struct DaemonRequest
+{
+    uint8_t signature[8];
+    uint8_t job;                            // Index into daemon_jobs
+    uint8_t flags;                          // DaemonFlags
+    uint32_t retries;
+    char filename[PATH_MAX];
+    char reference_filename[PATH_MAX];      // Empty without --reference
+};
+#pragma pack(pop)
+
+struct DaemonJob
+{
+    const char *name;
+    bool (*command)(int fd);
+};
+
+static const DaemonJob daemon_jobs[] =
+{
+    { "info",       info_command },
+    { "led on",     led_on_command },
+    { "led off",    led_off_command },
+    { "dump",       dump_tcrt_command },
+    { "flash",      flash_tcrt_command },
+    { "validate",   validate_tcrt_command }
+};
+
+#define DAEMON_JOB_COUNT (sizeof(daemon_jobs) / sizeof(daemon_jobs[0]))
+
+struct DaemonState
+{
+    char *device;
+    int fd;             // -1 until the port is open
+    bool initialized;   // Cart in command mode, cleared when a job fails
+    int saved_stdout;
+    int saved_stderr;
+    int saved_cwd;
+};
+
+static char *socket_path = NULL;
+static volatile sig_atomic_t daemon_client = -1;
+static volatile sig_atomic_t daemon_stopping = false;
+static volatile sig_atomic_t daemon_connection = -1;
+
+static int get_daemon_job(bool (*command)(int))
+{
+    for(uint32_t i = 0; i < DAEMON_JOB_COUNT; i++)
+    {
+        if(daemon_jobs[i].command == command)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void get_socket_directory(char *path, size_t size)
+{
+    const char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+
+    if(runtime_directory && runtime_directory[0] == '/')
+    {
+        snprintf(path, size, "%s", runtime_directory);
+    }
+    else
+    {
+        snprintf(path, size, DAEMON_SOCKET_DIR "%u", (unsigned)getuid());
+    }
+}
+
+// Create the socket directory, or make sure nobody else can reach into it
+static bool prepare_socket_directory(const char *path)
+{
+    struct stat directory_stat;
+
+    if((mkdir(path, S_IRWXU) == 0 || errno == EEXIST) && lstat(path, &directory_stat) == 0)
+    {
+        if(S_ISDIR(directory_stat.st_mode) && directory_stat.st_uid == getuid() &&
+           (directory_stat.st_mode & (S_IRWXG|S_IRWXO)) == 0)
+        {
+            return true;
+        }
+
+        fprintf(stderr, "%s must be a directory only you can access\n", path);
+        return false;
+    }
+
+    fprintf(stderr, "Failed to create %s. %s\n", path, strerror(errno));
+    return false;
+}
+
+static bool is_same_user(int connection)
+{
+#ifdef SO_PEERCRED
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+
+    return getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 &&
+           credentials.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(connection, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+// One socket per port, named after the resolved device path so that the same
+// port reached through a symlink gets the same socket
+static bool get_socket_address(const char *device, sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    int length;
+    if(socket_path)
+    {
+        length = snprintf(address->sun_path, sizeof(address->sun_path), "%s", socket_path);
+    }
+    else
+    {
+        char name[PATH_MAX];
+        if(!realpath(device, name))
+        {
+            snprintf(name, sizeof(name), "%s", device);
+        }
+
+        // /dev/ttyACM0 becomes dev_ttyACM0
+        char *location = name;
+        while(*location == '/')
+        {
+            location++;
+        }
+        for(char *c = location; *c; c++)
+        {
+            *c = *c == '/' ? '_' : *c;
+        }
+
+        char directory[PATH_MAX];
+        get_socket_directory(directory, sizeof(directory));
+
+        length = snprintf(address->sun_path, sizeof(address->sun_path), "%s/tapecart_flasher.%s.sock",
+                          directory, location);
+    }
+
+    if(length < 0 || (size_t)length >= sizeof(address->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    return true;
+}
+
+// Returns the connection, or -1 when no daemon serves the device
+static int connect_daemon(const char *device)
+{
+    sockaddr_un address;
+    if(!get_socket_address(device, &address))
+    {
+        return -1;
+    }
+
+    int connection = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    if(connection != -1 && connect(connection, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(connection);
+        connection = -1;
+    }
+
+    // Never hand our output and directory to someone else's socket
+    if(connection != -1 && !is_same_user(connection))
+    {
+        fprintf(stderr, "Warning: Ignoring %s, it belongs to another user\n", address.sun_path);
+        close(connection);
+        connection = -1;
+    }
+
+    return connection;
+}
+
+static bool send_daemon_request(int connection, DaemonRequest *request, int *fds)
+{
+    union
+    {
+        cmsghdr header;
+        uint8_t data[CMSG_SPACE(sizeof(int) * DAEMON_REQUEST_FDS)];
+    } control = {};
+
+    iovec iov = { request, sizeof(*request) };
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * DAEMON_REQUEST_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * DAEMON_REQUEST_FDS);
+
+    ssize_t result;
+    do
+    {
+        result = sendmsg(connection, &message, MSG_NOSIGNAL);
+    }
+    while(result == -1 && errno == EINTR);
+
+    return result == sizeof(*request);
+}
+
+// The received descriptors are only kept for a valid request
+static bool receive_daemon_request(int client, DaemonRequest *request, int *fds)
+{
+    union
+    {
+        cmsghdr header;
+        uint8_t data[CMSG_SPACE(sizeof(int) * DAEMON_REQUEST_FDS)];
+    } control = {};
+
+    iovec iov = { request, sizeof(*request) };
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    ssize_t size;
+    do
+    {
+        size = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+    }
+    while(size == -1 && errno == EINTR);
+
+    uint32_t fd_count = 0;
+    cmsghdr *cmsg = size > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (fd_count < DAEMON_REQUEST_FDS ? fd_count : DAEMON_REQUEST_FDS));
+    }
+
+    if(size == sizeof(*request) && !(message.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) &&
+       fd_count == DAEMON_REQUEST_FDS &&
+       memcmp(request->signature, DAEMON_SIGNATURE, sizeof(request->signature)) == 0 &&
+       request->job < DAEMON_JOB_COUNT)
+    {
+        request->filename[sizeof(request->filename) - 1] = '\0';
+        request->reference_filename[sizeof(request->reference_filename) - 1] = '\0';
+        return true;
+    }
+
+    for(uint32_t i = 0; i < fd_count && i < DAEMON_REQUEST_FDS; i++)
+    {
+        close(fds[i]);
+    }
+
+    // A client that refused its job locally just closes the connection
+    if(size != 0)
+    {
+        fprintf(stderr, "Ignoring invalid request\n");
+    }
+
+    return false;
+}
+
+// Open the port when needed and put the cart into command mode
+static bool init_daemon_link(DaemonState *state)
+{
+    if(state->fd == -1)
+    {
+        state->fd = open_serial_port(state->device);
+        if(state->fd == -1)
+        {
+            fprintf(stderr, "Failed to open %s. %s\n", state->device, strerror(errno));
+            return false;
+        }
+
+        if(!setup_serial_port(state->fd, baud_rate))
+        {
+            fprintf(stderr, "Failed to setup serial port. %s\n", strerror(errno));
+            close(state->fd);
+            state->fd = -1;
+            return false;
+        }
+    }
+
+    state->initialized = init_tapecart(state->fd, false);
+    if(!state->initialized)
+    {
+        // Start over with a fresh port for the next job, the adapter may have been replugged
+        close(state->fd);
+        state->fd = -1;
+    }
+
+    return state->initialized;
+}
+
+// The client closing the connection or sending anything stops the job after the current block
+static void daemon_io_handler(int)
+{
+    int saved_errno = errno;
+    pollfd pfd = { daemon_client, POLLIN, 0 };
+
+    if(daemon_client != -1 && poll(&pfd, 1, 0) > 0)
+    {
+        interrupted = true;
+    }
+
+    errno = saved_errno;
+}
+
+static void daemon_stop_handler(int)
+{
+    daemon_stopping = true;
+    interrupted = true;
+}
+
+static bool run_daemon_job(DaemonState *state, DaemonRequest *request, int *fds)
+{
+    const DaemonJob *job = &daemon_jobs[request->job];
+
+    diff_flash = request->flags & DaemonFlags_Diff;
+    verify_flash = request->flags & DaemonFlags_Verify;
+    sparse_dump = request->flags & DaemonFlags_Sparse;
+    compress_dump = request->flags & DaemonFlags_Compress;
+    resume_journal = request->flags & DaemonFlags_Resume;
+    block_retries = request->retries;
+    filename = request->filename;
+    reference_filename = request->reference_filename[0] ? request->reference_filename : NULL;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.start_us = get_time_us();
+    command_observer = request->flags & DaemonFlags_Stats ? record_command_stats : NULL;
+
+    // Print to the client and open its files relative to its working directory
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+
+    bool result = false;
+    if(fchdir(fds[2]) != 0)
+    {
+        fprintf(stderr, "Failed to change to the client directory. %s\n", strerror(errno));
+    }
+    else if(state->initialized || init_daemon_link(state))
+    {
+        if(job->command == info_command)
+        {
+            print_arduino_version();
+        }
+
+        result = job->command(state->fd);
+        state->initialized = result;
+    }
+
+    if(request->flags & DaemonFlags_Stats)
+    {
+        print_stats(1);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(state->saved_stdout, STDOUT_FILENO);
+    dup2(state->saved_stderr, STDERR_FILENO);
+    if(fchdir(state->saved_cwd) != 0)
+    {
+        fprintf(stderr, "Failed to change back to the daemon directory. %s\n", strerror(errno));
+    }
+
+    return result;
+}
+
+static void serve_daemon_client(DaemonState *state, int client)
+{
+    DaemonRequest request;
+    int fds[DAEMON_REQUEST_FDS];
+
+    if(!receive_daemon_request(client, &request, fds))
+    {
+        return;
+    }
+
+    interrupted = false;
+    daemon_client = client;
+    if(fcntl(client, F_SETOWN, getpid()) == 0)
+    {
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_ASYNC);
+    }
+    daemon_io_handler(SIGIO);   // Catch a Ctrl-C sent before O_ASYNC was set
+
+    uint8_t result = run_daemon_job(state, &request, fds);
+    daemon_client = -1;
+
+    printf("%s%s%s %s\n", daemon_jobs[request.job].name, request.filename[0] ? " " : "", request.filename,
+           result ? "OK" : "FAILED");
+    send(client, &result, sizeof(result), MSG_NOSIGNAL);
+
+    for(int i = 0; i < DAEMON_REQUEST_FDS; i++)
+    {
+        close(fds[i]);
+    }
+}
+
+static bool run_daemon(char *device)
+{
+    sockaddr_un address;
+    if(!get_socket_address(device, &address))
+    {
+        fprintf(stderr, "Invalid socket path. %s\n", strerror(errno));
+        return false;
+    }
+
+    char directory[PATH_MAX];
+    get_socket_directory(directory, sizeof(directory));
+    if(!socket_path && !prepare_socket_directory(directory))
+    {
+        return false;
+    }
+
+    // A socket nobody answers on is left over from a daemon that died
+    int other = connect_daemon(device);
+    if(other != -1)
+    {
+        close(other);
+        fprintf(stderr, "A daemon already serves %s on %s\n", device, address.sun_path);
+        return false;
+    }
+
+    DaemonState state = { device, -1, false, -1, -1, -1 };
+    if(!init_daemon_link(&state))
+    {
+        return false;
+    }
+
+    print_arduino_version();
+
+    int server = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+    unlink(address.sun_path);
+
+    // Only the owner may connect, jobs run with the daemon's permissions
+    mode_t saved_umask = umask(S_IRWXG|S_IRWXO);
+    bool listening = server != -1 && bind(server, (sockaddr *)&address, sizeof(address)) == 0 && listen(server, 8) == 0;
+    umask(saved_umask);
+
+    if(!listening)
+    {
+        fprintf(stderr, "Failed to listen on %s. %s\n", address.sun_path, strerror(errno));
+        if(server != -1)
+        {
+            close(server);
+        }
+        close(state.fd);
+        return false;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = daemon_stop_handler;
+    sigaction(SIGINT, &action, NULL);   // No SA_RESTART, so accept() returns
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = daemon_io_handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGIO, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);           // A client may go away while the job prints
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    state.saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    state.saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+    state.saved_cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    bool result = state.saved_stdout != -1 && state.saved_stderr != -1 && state.saved_cwd != -1;
+    if(result)
+    {
+        printf("Waiting for jobs on %s\n", address.sun_path);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to save the daemon output. %s\n", strerror(errno));
+    }
+
+    while(result && !daemon_stopping)
+    {
+        int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if(client != -1)
+        {
+            if(is_same_user(client))
+            {
+                serve_daemon_client(&state, client);
+            }
+            else
+            {
+                fprintf(stderr, "Rejected a client of another user\n");
+            }
+
+            close(client);
+        }
+        else if(errno != EINTR && errno != ECONNABORTED)
+        {
+            fprintf(stderr, "Failed to accept a client. %s\n", strerror(errno));
+            result = false;
+        }
+    }
+
+    close(server);
+    unlink(address.sun_path);
+    if(state.fd != -1)
+    {
+        close(state.fd);
+    }
+
+    printf("Daemon stopped\n");
+    return result;
+}
+
+static void client_interrupt_handler(int signal_number)
+{
+    // Ask the daemon to finish the current block, a second Ctrl-C only ends the client
+    uint8_t request = 0;
+    send(daemon_connection, &request, sizeof(request), MSG_NOSIGNAL);
+    signal(signal_number, SIG_DFL);
+}
+
+static bool run_daemon_client(int connection, bool (*command)(int), bool print_statistics)
+{
+    int job = get_daemon_job(command);
+    if(job == -1)
+    {
+        fprintf(stderr, "A daemon owns the port and only runs info, led, dump, flash and validate\n");
+        return false;
+    }
+
+    DaemonRequest request = {};
+    memcpy(request.signature, DAEMON_SIGNATURE, sizeof(request.signature));
+    request.job = job;
+    request.flags = (diff_flash ? DaemonFlags_Diff : DaemonFlags_None) |
+                    (verify_flash ? DaemonFlags_Verify : DaemonFlags_None) |
+                    (sparse_dump ? DaemonFlags_Sparse : DaemonFlags_None) |
+                    (compress_dump ? DaemonFlags_Compress : DaemonFlags_None) |
+                    (resume_journal ? DaemonFlags_Resume : DaemonFlags_None) |
+                    (print_statistics ? DaemonFlags_Stats : DaemonFlags_None);
+    request.retries = block_retries;
+
+    if((filename && snprintf(request.filename, sizeof(request.filename), "%s", filename) >= PATH_MAX) ||
+       (reference_filename &&
+        snprintf(request.reference_filename, sizeof(request.reference_filename), "%s", reference_filename) >= PATH_MAX))
+    {
+        fprintf(stderr, "File name too long\n");
+        return false;
+    }
+
+    int fds[DAEMON_REQUEST_FDS] = { STDOUT_FILENO, STDERR_FILENO, open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC) };
+    if(fds[2] == -1)
+    {
+        fprintf(stderr, "Failed to open the working directory. %s\n", strerror(errno));
+        return false;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    uint8_t result = false;
+    if(send_daemon_request(connection, &request, fds))
+    {
+        daemon_connection = connection;
+        signal(SIGINT, client_interrupt_handler);
+
+        ssize_t size;
+        do
+        {
+            size = recv(connection, &result, sizeof(result), 0);
+        }
+        while(size == -1 && errno == EINTR);
+
+        if(size != sizeof(result))
+        {
+            fprintf(stderr, "Daemon closed the connection\n");
+            result = false;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Failed to send the job to the daemon. %s\n", strerror(errno));
+    }
+
+    close(fds[2]);
+    return result;
+}
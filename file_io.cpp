@@ -22,6 +22,7 @@ static int open_file(char *pathname, int flags, mode_t mode = 0)
 
 static bool read_file(int fd, void *buffer, size_t size)
 {
+    uint64_t start_us = get_time_us();
     ssize_t total_bytes_read = 0;
     uint8_t *buffer_location = (uint8_t*)buffer;
 
@@ -39,11 +40,15 @@ static bool read_file(int fd, void *buffer, size_t size)
         }
     }
 
+    add_phase_time(StatsPhase_FileIo, get_time_us() - start_us);
+    stats.file_bytes += total_bytes_read;
+
     return total_bytes_read == size;
 }
 
 static bool write_file(int fd, void *buffer, size_t size)
 {
+    uint64_t start_us = get_time_us();
     ssize_t total_bytes_written = 0;
     uint8_t *buffer_location = (uint8_t*)buffer;
 
@@ -61,5 +66,60 @@ static bool write_file(int fd, void *buffer, size_t size)
         }
     }
 
+    add_phase_time(StatsPhase_FileIo, get_time_us() - start_us);
+    stats.file_bytes += total_bytes_written;
+
+    return total_bytes_written == size;
+}
+
+static bool read_file_at(int fd, void *buffer, size_t size, off_t offset)
+{
+    uint64_t start_us = get_time_us();
+    ssize_t total_bytes_read = 0;
+    uint8_t *buffer_location = (uint8_t*)buffer;
+
+    while(total_bytes_read < size)
+    {
+        ssize_t bytes_read = pread(fd, buffer_location, size - total_bytes_read, offset + total_bytes_read);
+        if(bytes_read > 0)
+        {
+            total_bytes_read += bytes_read;
+            buffer_location += bytes_read;
+        }
+        else if(bytes_read != -1 || errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    add_phase_time(StatsPhase_FileIo, get_time_us() - start_us);
+    stats.file_bytes += total_bytes_read;
+
+    return total_bytes_read == size;
+}
+
+static bool write_file_at(int fd, void *buffer, size_t size, off_t offset)
+{
+    uint64_t start_us = get_time_us();
+    ssize_t total_bytes_written = 0;
+    uint8_t *buffer_location = (uint8_t*)buffer;
+
+    while(total_bytes_written < size)
+    {
+        ssize_t bytes_written = pwrite(fd, buffer_location, size - total_bytes_written, offset + total_bytes_written);
+        if(bytes_written > 0)
+        {
+            total_bytes_written += bytes_written;
+            buffer_location += bytes_written;
+        }
+        else if(bytes_written != -1 || errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    add_phase_time(StatsPhase_FileIo, get_time_us() - start_us);
+    stats.file_bytes += total_bytes_written;
+
     return total_bytes_written == size;
 }
@@ -0,0 +1,177 @@
+// Progress journal kept next to the image while dumping, flashing or
+// validating, so an interrupted job can be continued with --resume.
+
+#include <signal.h>
+#include <limits.h>
+
+#define JOURNAL_SIGNATURE "TCJRNL01"
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAX_BLOCKS 4096     // 16 MB in 4K blocks
+
+enum JournalOperation : uint8_t
+{
+    JournalOperation_Dump = 1,
+    JournalOperation_Flash,
+    JournalOperation_Validate
+};
+
+#pragma pack(push)
+#pragma pack(1)
+struct JournalData
+{
+    uint8_t signature[8];
+    JournalOperation operation;
+    uint32_t image_crc32;           // Whole TCRT file, or the Tapecart header when dumping
+    uint32_t flash_content_length;
+    uint32_t block_size;
+    DeviceInfo device_info;
+    uint8_t done_blocks[JOURNAL_MAX_BLOCKS / 8];
+};
+#pragma pack(pop)
+
+struct Journal
+{
+    int file;   // -1 when no journal is kept
+    char filename[PATH_MAX];
+    JournalData data;
+};
+
+static bool resume_journal = false;   // Continue from an existing journal
+static volatile sig_atomic_t interrupted = false;
+
+static void interrupt_handler(int signal_number)
+{
+    // Let the current block finish, a second Ctrl-C terminates right away
+    interrupted = true;
+    signal(signal_number, SIG_DFL);
+}
+
+static bool write_journal(Journal *journal)
+{
+    if(journal->file == -1)
+    {
+        return true;
+    }
+
+    if(lseek(journal->file, 0, SEEK_SET) == 0 && write_file(journal->file, &journal->data, sizeof(journal->data)))
+    {
+        return true;
+    }
+
+    print_link_message(stderr, "Failed to write journal %s. %s\n", journal->filename, strerror(errno));
+    return false;
+}
+
+static uint32_t count_done_blocks(Journal *journal)
+{
+    uint32_t count = 0;
+    for(size_t i = 0; i < sizeof(journal->data.done_blocks); i++)
+    {
+        count += __builtin_popcount(journal->data.done_blocks[i]);
+    }
+
+    return count;
+}
+
+// Open the journal for image_filename. With --resume the completed blocks of
+// a matching journal are kept, otherwise the journal starts out empty. A
+// missing journal is not an error, the job just cannot be resumed.
+static void open_journal(Journal *journal, int fd, const char *image_filename, JournalOperation operation,
+                         uint32_t image_crc32, uint32_t flash_content_length, uint32_t block_size)
+{
+    JournalData *data = &journal->data;
+    journal->file = -1;
+
+    memset(data, 0, sizeof(*data));
+    memcpy(data->signature, JOURNAL_SIGNATURE, sizeof(data->signature));
+    data->operation = operation;
+    data->image_crc32 = image_crc32;
+    data->flash_content_length = flash_content_length;
+    data->block_size = block_size;
+
+    uint32_t block_count = (flash_content_length + block_size - 1) / block_size;
+    if(block_count > JOURNAL_MAX_BLOCKS || !get_device_info(fd, &data->device_info))
+    {
+        print_link_message(stderr, "Warning: No progress journal, the job cannot be resumed\n");
+        return;
+    }
+
+    snprintf(journal->filename, sizeof(journal->filename), "%s" JOURNAL_SUFFIX, image_filename);
+    journal->file = open_file(journal->filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if(journal->file == -1)
+    {
+        print_link_message(stderr, "Warning: Failed to open journal %s. %s\n", journal->filename, strerror(errno));
+        return;
+    }
+
+    if(resume_journal)
+    {
+        JournalData saved;
+        if(read_file(journal->file, &saved, sizeof(saved)) &&
+           memcmp(saved.signature, data->signature, sizeof(saved.signature)) == 0 &&
+           saved.operation == data->operation &&
+           saved.image_crc32 == data->image_crc32 &&
+           saved.flash_content_length == data->flash_content_length &&
+           saved.block_size == data->block_size &&
+           memcmp(&saved.device_info, &data->device_info, sizeof(saved.device_info)) == 0)
+        {
+            memcpy(data->done_blocks, saved.done_blocks, sizeof(data->done_blocks));
+            print_link_message(stdout, "Resuming with %u of %u blocks done\n",
+                               count_done_blocks(journal), block_count);
+        }
+        else
+        {
+            print_link_message(stdout, "No matching journal in %s, starting from the beginning\n", journal->filename);
+        }
+    }
+
+    if(ftruncate(journal->file, 0) != 0 || !write_journal(journal))
+    {
+        close(journal->file);
+        journal->file = -1;
+        return;
+    }
+}
+
+static bool is_block_done(Journal *journal, uint32_t address)
+{
+    if(journal->file == -1)
+    {
+        return false;
+    }
+
+    uint32_t block = address / journal->data.block_size;
+    return journal->data.done_blocks[block / 8] & (1 << (block % 8));
+}
+
+static void mark_block_done(Journal *journal, uint32_t address)
+{
+    if(journal->file != -1)
+    {
+        uint32_t block = address / journal->data.block_size;
+        journal->data.done_blocks[block / 8] |= 1 << (block % 8);
+        write_journal(journal);
+    }
+}
+
+// Remove the journal when the job completed, otherwise keep it for --resume
+static void close_journal(Journal *journal, bool completed)
+{
+    if(journal->file == -1)
+    {
+        return;
+    }
+
+    close(journal->file);
+
+    if(completed)
+    {
+        unlink(journal->filename);
+    }
+    else
+    {
+        print_link_message(stdout, "Progress saved in %s, continue with --resume\n", journal->filename);
+    }
+
+    journal->file = -1;
+}
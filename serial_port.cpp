@@ -1,9 +1,92 @@
 #include <termios.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#define DEFAULT_BAUD_RATE 115200
+#define DEFAULT_TIMEOUT_MS 3000     // Used when no command deadline is set
+#define SERIAL_RX_BUFFER_SIZE 4096  // NOTE: Must be a power of two
+
+// Received bytes not yet consumed by the frame parser. head and tail are
+// free-running counters, masked when indexing.
+struct SerialRxBuffer
+{
+    uint8_t data[SERIAL_RX_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+};
+
+// Link state is per thread, gang mode drives one port from each worker
+static thread_local SerialRxBuffer rx_buffer;
+static thread_local uint32_t serial_baud_rate = DEFAULT_BAUD_RATE;
+static thread_local uint64_t serial_deadline;   // CLOCK_MONOTONIC milliseconds
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || defined(__arm__))
+// Kernel termios2 for arbitrary baud rates. Declared here as <asm/termbits.h>
+// clashes with <termios.h>.
+struct SerialTermios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+#define SERIAL_TCGETS2 _IOR('T', 0x2A, SerialTermios2)
+#define SERIAL_TCSETS2 _IOW('T', 0x2B, SerialTermios2)
+#define SERIAL_BOTHER  0010000
+#endif
+
+// All reads and writes until the next call must complete within timeout_ms
+static void set_serial_deadline(uint32_t timeout_ms)
+{
+    serial_deadline = get_time_ms() + timeout_ms;
+}
+
+// Milliseconds needed to move size bytes over the link, 10 bits per byte
+static uint32_t get_serial_transfer_ms(size_t size)
+{
+    return (uint32_t)((size * 10 * 1000ull + serial_baud_rate - 1) / serial_baud_rate);
+}
+
+static bool wait_for_serial_port(int fd, short events)
+{
+    while(true)
+    {
+        uint64_t now = get_time_ms();
+        if(now >= serial_deadline)
+        {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        pollfd pfd = { fd, events, 0 };
+        int result = poll(&pfd, 1, (int)(serial_deadline - now));
+
+        if(result > 0)
+        {
+            // A hangup or error without the requested event means the link is gone
+            if(!(pfd.revents & events) && (pfd.revents & (POLLHUP|POLLERR|POLLNVAL)))
+            {
+                errno = EIO;
+                return false;
+            }
+            return true;
+        }
+        else if(result == -1 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
 
 static int open_serial_port(char *device)
 {
-    int fd = open_file(device, O_RDWR);
+    int fd = open_file(device, O_RDWR|O_NOCTTY|O_NONBLOCK);
 
     if(fd != -1 && isatty(fd) == 0)
     {
@@ -14,21 +97,194 @@ static int open_serial_port(char *device)
     return fd;
 }
 
+// Pull whatever the tty has available, up to the free space in the ring buffer
+static bool fill_rx_buffer(int fd)
+{
+    size_t offset = rx_buffer.tail & (SERIAL_RX_BUFFER_SIZE - 1);
+    size_t free_size = SERIAL_RX_BUFFER_SIZE - (rx_buffer.tail - rx_buffer.head);
+    size_t contiguous_size = SERIAL_RX_BUFFER_SIZE - offset;
+    bool readable = false;
+
+    while(true)
+    {
+        ssize_t bytes_read = read(fd, rx_buffer.data + offset,
+                                  free_size < contiguous_size ? free_size : contiguous_size);
+        if(bytes_read > 0)
+        {
+            rx_buffer.tail += bytes_read;
+            stats.bytes_received += bytes_read;
+            return true;
+        }
+        else if(bytes_read == 0 && readable)
+        {
+            // poll said readable but there is nothing to read: the port was hung up
+            errno = EIO;
+            return false;
+        }
+        else if(bytes_read == 0 || errno == EAGAIN)
+        {
+            if(!wait_for_serial_port(fd, POLLIN))
+            {
+                return false;
+            }
+            readable = true;
+        }
+        else if(errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
 static bool read_bytes(int fd, void *buffer, size_t size)
 {
-    return read_file(fd, buffer, size);
+    uint8_t *buffer_location = (uint8_t *)buffer;
+
+    while(size > 0)
+    {
+        if(rx_buffer.head == rx_buffer.tail && !fill_rx_buffer(fd))
+        {
+            return false;
+        }
+
+        size_t offset = rx_buffer.head & (SERIAL_RX_BUFFER_SIZE - 1);
+        size_t copy_size = rx_buffer.tail - rx_buffer.head;
+
+        if(copy_size > SERIAL_RX_BUFFER_SIZE - offset)
+        {
+            copy_size = SERIAL_RX_BUFFER_SIZE - offset;
+        }
+        if(copy_size > size)
+        {
+            copy_size = size;
+        }
+
+        memcpy(buffer_location, rx_buffer.data + offset, copy_size);
+        rx_buffer.head += copy_size;
+        buffer_location += copy_size;
+        size -= copy_size;
+    }
+
+    return true;
+}
+
+// Send several buffers with as few writes as possible. Modifies iov.
+static bool send_iovec(int fd, struct iovec *iov, int count)
+{
+    while(count > 0)
+    {
+        ssize_t bytes_written = writev(fd, iov, count);
+        if(bytes_written > 0)
+        {
+            stats.bytes_sent += bytes_written;
+
+            // Skip what was written, a partial write continues in the middle of a buffer
+            while(count > 0 && (size_t)bytes_written >= iov->iov_len)
+            {
+                bytes_written -= iov->iov_len;
+                iov++;
+                count--;
+            }
+
+            if(count > 0)
+            {
+                iov->iov_base = (uint8_t *)iov->iov_base + bytes_written;
+                iov->iov_len -= bytes_written;
+            }
+        }
+        else if(bytes_written == 0 || errno == EAGAIN)
+        {
+            if(!wait_for_serial_port(fd, POLLOUT))
+            {
+                return false;
+            }
+        }
+        else if(errno != EINTR)
+        {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 static bool send_bytes(int fd, void *buffer, size_t size)
 {
-    return write_file(fd, buffer, size);
+    struct iovec iov = { buffer, size };
+    return send_iovec(fd, &iov, 1);
 }
 
-static bool setup_serial_port(int fd)
-{   
+static speed_t get_speed_constant(uint32_t baud_rate)
+{
+    switch(baud_rate)
+    {
+        case 9600:      return B9600;
+        case 19200:     return B19200;
+        case 38400:     return B38400;
+        case 57600:     return B57600;
+        case 115200:    return B115200;
+        case 230400:    return B230400;
+#ifdef B460800
+        case 460800:    return B460800;
+        case 500000:    return B500000;
+        case 921600:    return B921600;
+        case 1000000:   return B1000000;
+        case 2000000:   return B2000000;
+#endif
+        default:        return B0;
+    }
+}
+
+static bool set_serial_speed(int fd, uint32_t baud_rate)
+{
+#ifdef SERIAL_BOTHER
+    // Use termios2 so that non-standard rates work as well
+    SerialTermios2 tio2;
+    if(ioctl(fd, SERIAL_TCGETS2, &tio2) != -1)
+    {
+        tio2.c_cflag &= ~CBAUD;
+        tio2.c_cflag |= SERIAL_BOTHER;
+        tio2.c_ispeed = baud_rate;
+        tio2.c_ospeed = baud_rate;
+
+        if(ioctl(fd, SERIAL_TCSETS2, &tio2) != -1)
+        {
+            serial_baud_rate = baud_rate;
+            return true;
+        }
+
+        return false;
+    }
+#endif
+
+    speed_t speed = get_speed_constant(baud_rate);
+    if(speed == B0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    termios tio = {};
+    if(tcgetattr(fd, &tio) != -1 &&
+       cfsetospeed(&tio, speed) != -1 &&
+       cfsetispeed(&tio, speed) != -1 &&
+       tcsetattr(fd, TCSANOW, &tio) != -1)
+    {
+        serial_baud_rate = baud_rate;
+        return true;
+    }
+
+    return false;
+}
+
+static bool setup_serial_port(int fd, uint32_t baud_rate)
+{
     bool result = false;
 
     termios tio = {};
+    set_serial_deadline(DEFAULT_TIMEOUT_MS);
+    serial_baud_rate = DEFAULT_BAUD_RATE;
+
     if(tcgetattr(fd, &tio) != -1)
     {
         tio.c_iflag &= ~(IGNBRK|BRKINT|ICRNL|INLCR|     // Turn off input processing
@@ -43,15 +299,15 @@ static bool setup_serial_port(int fd)
         tio.c_cflag &= ~(CSIZE|PARENB|CRTSCTS|HUPCL);   // 8n1, no hardware flow control
         tio.c_cflag |= CS8|CSTOPB|CREAD|CLOCAL;
 
-        tio.c_cc[VMIN] = 0;
-        tio.c_cc[VTIME] = 30;                           // 3.0 seconds timeout
+        tio.c_cc[VMIN] = 0;                             // Non-blocking, timeouts are
+        tio.c_cc[VTIME] = 0;                            // handled with poll()
 
         if(cfsetospeed(&tio, B115200) != -1 &&          // 115200 baud
            cfsetispeed(&tio, B115200) != -1)
         {
             if(tcsetattr(fd, TCSANOW, &tio) != -1)
             {
-                result = true;
+                result = baud_rate == DEFAULT_BAUD_RATE || set_serial_speed(fd, baud_rate);
             }
         }
     }
@@ -81,4 +337,5 @@ static void discard_rx_buffer(int fd)
 {
     usleep(10000);   // Work-around for USB serial port drivers
     tcflush(fd, TCIOFLUSH);
+    rx_buffer.head = rx_buffer.tail;
 }
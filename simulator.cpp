@@ -0,0 +1,694 @@
+// Emulates an Arduino running the TapecartFlasher sketch with a Tapecart
+// attached, speaking the protocol in commands.h on the master side of a PTY.
+
+#include <poll.h>
+
+#define SIM_DEBUG_TEXT "Simulated debug output\n"
+#define SIM_POLL_MS 10
+#define SIM_COMMAND_IDLE_MS 1000    // Drop a partially received command after this
+
+struct SimulatorConfig
+{
+    uint32_t flash_size;
+    uint16_t page_size;
+    uint16_t erase_pages;
+
+    uint8_t api_version;
+    bool fast_commands;         // Answer NotImplemented to the fast variants when false
+    uint16_t rx_window;         // Reported by ReadRxWindow from RX_WINDOW_API_VERSION on
+
+    uint32_t max_baud_rate;     // Highest rate SetBaudRate accepts from BAUD_RATE_API_VERSION on
+    uint32_t baud_rate;         // Modelled link speed, SetBaudRate rescales byte_delay_us when set
+    uint32_t byte_delay_us;     // Link time per byte in either direction
+    uint32_t command_delay_us;  // Processing time per command
+
+    double drop_rate;           // Probability to drop a byte of a response
+    double bad_checksum_rate;   // Probability to send a response with a bad checksum
+    double debug_rate;          // Probability to interleave debug output
+    double bad_write_rate;      // Probability that a page write clears a wrong bit
+
+    unsigned int seed;
+};
+
+struct Simulator
+{
+    SimulatorConfig config;
+    int fd;
+    volatile bool stop;
+
+    uint8_t *flash;
+    Loadinfo loadinfo;
+    InitialLoader loader;
+
+    bool command_mode;
+    uint16_t handshake_window;  // Payload bytes per ENQ, grows once the host asked for the window
+    bool led;
+    uint16_t debug_flags;
+
+    uint32_t dir_offset;
+    uint16_t dir_entries;
+    uint8_t dir_name_length;
+    uint8_t dir_data_length;
+
+    unsigned int random_state;
+    uint8_t rx_buffer[0x10000];
+    uint8_t tx_buffer[0x10000];
+};
+
+static void init_simulator_config(SimulatorConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+
+    config->flash_size = 2*1024*1024;
+    config->page_size = 256;
+    config->erase_pages = 16;
+    config->api_version = SUPPORTED_API_VERSION;
+    config->fast_commands = true;
+    config->rx_window = 256;
+    config->max_baud_rate = 2000000;
+    config->seed = 1;
+}
+
+static bool sim_chance(Simulator *sim, double rate)
+{
+    return rate > 0 && rand_r(&sim->random_state) < rate * ((double)RAND_MAX + 1);
+}
+
+static void sim_delay(uint64_t delay_us)
+{
+    if(delay_us)
+    {
+        usleep(delay_us);
+    }
+}
+
+static int open_simulator_pty(char *slave_path, size_t slave_path_size)
+{
+    int fd = posix_openpt(O_RDWR|O_NOCTTY);
+
+    if(fd != -1)
+    {
+        termios tio = {};
+        if(grantpt(fd) != -1 && unlockpt(fd) != -1 &&
+           ptsname_r(fd, slave_path, slave_path_size) == 0 &&
+           tcgetattr(fd, &tio) != -1)
+        {
+            cfmakeraw(&tio);
+            if(tcsetattr(fd, TCSANOW, &tio) != -1)
+            {
+                return fd;
+            }
+        }
+
+        close(fd);
+    }
+
+    return -1;
+}
+
+// Read from the PTY master. Waits indefinitely for the start of a command
+// when wait_for_host is set, otherwise gives up when the host goes quiet or
+// closes the port in the middle of a command.
+static bool sim_read_bytes(Simulator *sim, void *buffer, size_t size, bool wait_for_host)
+{
+    uint8_t *buffer_location = (uint8_t *)buffer;
+    size_t remaining = size;
+    uint32_t idle_ms = 0;
+
+    while(remaining > 0 && !sim->stop)
+    {
+        pollfd pfd = { sim->fd, POLLIN, 0 };
+        int result = poll(&pfd, 1, SIM_POLL_MS);
+        ssize_t bytes_read = -1;
+
+        if(result > 0 && (pfd.revents & POLLIN))
+        {
+            bytes_read = read(sim->fd, buffer_location, remaining);
+        }
+
+        if(bytes_read > 0)
+        {
+            buffer_location += bytes_read;
+            remaining -= bytes_read;
+            idle_ms = 0;
+        }
+        else if(result != -1 || errno != EINTR)
+        {
+            idle_ms += SIM_POLL_MS;
+            if(!wait_for_host && idle_ms >= SIM_COMMAND_IDLE_MS)
+            {
+                return false;
+            }
+
+            if(result != 0)
+            {
+                usleep(SIM_POLL_MS * 1000);     // No host connected, poll returns at once
+            }
+        }
+    }
+
+    sim_delay((uint64_t)sim->config.byte_delay_us * (size - remaining));
+    return remaining == 0;
+}
+
+static void sim_send_bytes(Simulator *sim, const void *buffer, size_t size)
+{
+    sim_delay((uint64_t)sim->config.byte_delay_us * size);
+
+    const uint8_t *buffer_location = (const uint8_t *)buffer;
+    while(size > 0 && !sim->stop)
+    {
+        ssize_t bytes_written = write(sim->fd, buffer_location, size);
+        if(bytes_written > 0)
+        {
+            buffer_location += bytes_written;
+            size -= bytes_written;
+        }
+        else if(bytes_written == -1 && errno != EINTR && errno != EAGAIN)
+        {
+            break;
+        }
+        else
+        {
+            usleep(1000);
+        }
+    }
+}
+
+static void sim_send_debug_output(Simulator *sim)
+{
+    if(sim_chance(sim, sim->config.debug_rate))
+    {
+        sim_send_bytes(sim, "*" SIM_DEBUG_TEXT, strlen("*" SIM_DEBUG_TEXT));
+    }
+}
+
+static void sim_send_response(Simulator *sim, CommandGroup group, uint8_t command, CommandResult result,
+                              const void *data = NULL, uint16_t length = 0)
+{
+    ReceiveCommandHeader header =
+    {
+        CommandPrefix_SOH,
+        group,
+        command,
+        result,
+        length
+    };
+
+    uint8_t *frame = sim->tx_buffer;
+    size_t frame_size = 0;
+
+    memcpy(frame, &header, sizeof(header));
+    frame_size += sizeof(header);
+    memcpy(frame + frame_size, data, length);
+    frame_size += length;
+
+    uint8_t checksum = 0;
+    for(size_t i = 1; i < frame_size; i++)
+    {
+        checksum ^= frame[i];
+    }
+    if(sim_chance(sim, sim->config.bad_checksum_rate))
+    {
+        checksum ^= 0x5A;
+    }
+    frame[frame_size++] = checksum;
+
+    if(frame_size > 1 && sim_chance(sim, sim->config.drop_rate))
+    {
+        size_t drop = rand_r(&sim->random_state) % frame_size;
+        memmove(frame + drop, frame + drop + 1, frame_size - drop - 1);
+        frame_size--;
+    }
+
+    sim_send_debug_output(sim);
+    sim_send_bytes(sim, frame, frame_size);
+}
+
+static bool sim_valid_range(Simulator *sim, uint32_t address, uint32_t length)
+{
+    return address <= sim->config.flash_size && length <= sim->config.flash_size - address;
+}
+
+static uint32_t sim_erase_block_size(Simulator *sim)
+{
+    return (uint32_t)sim->config.page_size * sim->config.erase_pages;
+}
+
+static void sim_erase(Simulator *sim, uint32_t address, uint32_t size)
+{
+    address -= address % size;
+    if(sim_valid_range(sim, address, size))
+    {
+        memset(sim->flash + address, 0xFF, size);
+    }
+}
+
+// NOR flash can only clear bits, writes without an erase corrupt the data
+static void sim_program(Simulator *sim, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    for(uint32_t i = 0; i < length; i++)
+    {
+        sim->flash[address + i] &= data[i];
+    }
+
+    if(length && sim_chance(sim, sim->config.bad_write_rate))
+    {
+        sim->flash[address + rand_r(&sim->random_state) % length] &= 0x7F;
+    }
+}
+
+static uint32_t sim_read24(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16);
+}
+
+static uint16_t sim_read16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+static void sim_dir_lookup(Simulator *sim, uint8_t *name, size_t name_size)
+{
+    uint8_t response[1 + 0xFF];
+    uint32_t entry_size = sim->dir_name_length + sim->dir_data_length;
+
+    memset(response, 0xFF, sizeof(response));
+    response[0] = 1;    // Not found
+
+    for(uint16_t i = 0; i < sim->dir_entries && name_size == sim->dir_name_length; i++)
+    {
+        uint32_t entry = sim->dir_offset + i * entry_size;
+        if(!sim_valid_range(sim, entry, entry_size))
+        {
+            break;
+        }
+
+        if(memcmp(sim->flash + entry, name, name_size) == 0)
+        {
+            response[0] = 0;
+            memcpy(response + 1, sim->flash + entry + sim->dir_name_length, sim->dir_data_length);
+            break;
+        }
+    }
+
+    sim_send_response(sim, CommandGroup_Tapecart, TapecartCommand_DirLookup, CommandResult_Ok,
+                      response, 1 + sim->dir_data_length);
+}
+
+static void sim_arduino_command(Simulator *sim, uint8_t command, uint8_t *data, uint16_t data_size)
+{
+    if(command == ArduinoCommand_Version)
+    {
+        ArduinoSketchVersion version =
+        {
+            2,
+            0,
+            sim->config.api_version,
+            ArduinoType_Uno
+        };
+
+        sim_send_response(sim, CommandGroup_Arduino, command, CommandResult_Ok, &version, sizeof(version));
+    }
+    else if(command == ArduinoCommand_StartCommandMode)
+    {
+        sim->command_mode = true;
+        sim_send_response(sim, CommandGroup_Arduino, command, CommandResult_Ok);
+    }
+    else if(command == ArduinoCommand_ReadRxWindow && sim->config.api_version >= RX_WINDOW_API_VERSION)
+    {
+        // Only a host that asked knows about the larger window
+        RxWindow rx_window = { sim->config.rx_window };
+        sim_send_response(sim, CommandGroup_Arduino, command, CommandResult_Ok, &rx_window, sizeof(rx_window));
+        sim->handshake_window = sim->config.rx_window;
+    }
+    else if(command == ArduinoCommand_SetBaudRate && sim->config.api_version >= BAUD_RATE_API_VERSION &&
+            data_size == sizeof(BaudRate))
+    {
+        // A PTY has no line rate to lose sync on, so the switch always holds
+        BaudRate baud_rate;
+        memcpy(&baud_rate, data, sizeof(baud_rate));
+        if(baud_rate.rate == 0 || baud_rate.rate > sim->config.max_baud_rate)
+        {
+            baud_rate.rate = 0;
+        }
+
+        sim_send_response(sim, CommandGroup_Arduino, command, CommandResult_Ok, &baud_rate, sizeof(baud_rate));
+        if(baud_rate.rate != 0 && sim->config.baud_rate != 0)
+        {
+            sim->config.baud_rate = baud_rate.rate;
+            sim->config.byte_delay_us = 10 * 1000000 / baud_rate.rate;
+        }
+    }
+    else
+    {
+        sim_send_response(sim, CommandGroup_Arduino, command, CommandResult_NotImplemented);
+    }
+}
+
+static void sim_tapecart_command(Simulator *sim, uint8_t command, uint8_t *data, uint16_t data_size)
+{
+    const CommandGroup group = CommandGroup_Tapecart;
+    CommandResult result = CommandResult_Error;
+
+    if(!sim->command_mode)
+    {
+        sim_send_response(sim, group, command, CommandResult_Error);
+        return;
+    }
+
+    switch(command)
+    {
+        case TapecartCommand_Exit:
+            sim->command_mode = false;
+            result = CommandResult_Ok;
+            break;
+
+        case TapecartCommand_ReadDeviceinfo:
+        {
+            const char *info = "Tapecart simulator";
+            sim_send_response(sim, group, command, CommandResult_Ok, info, strlen(info));
+            return;
+        }
+
+        case TapecartCommand_ReadDevicesizes:
+        {
+            DeviceSizes sizes = {};
+            sizes.total_size = sim->config.flash_size;
+            sizes.page_size = sim->config.page_size;
+            sizes.erase_pages = sim->config.erase_pages;
+
+            sim_send_response(sim, group, command, CommandResult_Ok, &sizes, sizeof(sizes));
+            return;
+        }
+
+        case TapecartCommand_ReadCapabilities:
+        {
+            uint32_t capabilities = 0;
+            sim_send_response(sim, group, command, CommandResult_Ok, &capabilities, sizeof(capabilities));
+            return;
+        }
+
+        case TapecartCommand_ReadFlashFast:
+            if(!sim->config.fast_commands)
+            {
+                result = CommandResult_NotImplemented;
+                break;
+            }
+            // Fall through
+        case TapecartCommand_ReadFlash:
+            if(data_size == sizeof(ReadFlash))
+            {
+                uint32_t address = sim_read24(data);
+                uint16_t length = sim_read16(data + 3);
+                uint16_t max_length = command == TapecartCommand_ReadFlash ? 0x100 : FAST_FLASH_MAX_LENGTH;
+
+                if(length <= max_length && sim_valid_range(sim, address, length))
+                {
+                    sim_send_response(sim, group, command, CommandResult_Ok, sim->flash + address, length);
+                    return;
+                }
+            }
+            break;
+
+        case TapecartCommand_WriteFlashFast:
+            if(!sim->config.fast_commands)
+            {
+                result = CommandResult_NotImplemented;
+                break;
+            }
+            // Fall through
+        case TapecartCommand_WriteFlash:
+            if(data_size >= offsetof(WriteFlash, data))
+            {
+                uint32_t address = sim_read24(data);
+                uint16_t length = sim_read16(data + 3);
+                uint16_t max_length = command == TapecartCommand_WriteFlash ? 0x100 : FAST_FLASH_MAX_LENGTH;
+
+                if(length <= max_length && length <= data_size - offsetof(WriteFlash, data) &&
+                   sim_valid_range(sim, address, length))
+                {
+                    sim_program(sim, address, data + offsetof(WriteFlash, data), length);
+                    result = CommandResult_Ok;
+                }
+            }
+            break;
+
+        case TapecartCommand_EraseFlash64K:
+        case TapecartCommand_EraseFlashBlock:
+            if(data_size == sizeof(EraseFlash))
+            {
+                uint32_t address = sim_read24(data);
+                if(address < sim->config.flash_size)
+                {
+                    sim_erase(sim, address, command == TapecartCommand_EraseFlash64K ?
+                                            0x10000 : sim_erase_block_size(sim));
+                    result = CommandResult_Ok;
+                }
+            }
+            break;
+
+        case TapecartCommand_Crc32Flash:
+            if(data_size == sizeof(ReadCrc32Flash))
+            {
+                uint32_t address = sim_read24(data);
+                uint32_t length = sim_read24(data + 3);
+
+                if(sim_valid_range(sim, address, length))
+                {
+                    uint32_t crc = calculate_crc32(sim->flash + address, length);
+                    sim_send_response(sim, group, command, CommandResult_Ok, &crc, sizeof(crc));
+                    return;
+                }
+            }
+            break;
+
+        case TapecartCommand_ReadLoader:
+            sim_send_response(sim, group, command, CommandResult_Ok, &sim->loader, sizeof(sim->loader));
+            return;
+
+        case TapecartCommand_ReadLoadinfo:
+            sim_send_response(sim, group, command, CommandResult_Ok, &sim->loadinfo, sizeof(sim->loadinfo));
+            return;
+
+        case TapecartCommand_WriteLoader:
+            if(data_size == sizeof(sim->loader))
+            {
+                memcpy(&sim->loader, data, sizeof(sim->loader));
+                result = CommandResult_Ok;
+            }
+            break;
+
+        case TapecartCommand_WriteLoadinfo:
+            if(data_size == sizeof(sim->loadinfo))
+            {
+                memcpy(&sim->loadinfo, data, sizeof(sim->loadinfo));
+                result = CommandResult_Ok;
+            }
+            break;
+
+        case TapecartCommand_LedOff:
+        case TapecartCommand_LedOn:
+            sim->led = command == TapecartCommand_LedOn;
+            result = CommandResult_Ok;
+            break;
+
+        case TapecartCommand_ReadDebugflags:
+            sim_send_response(sim, group, command, CommandResult_Ok, &sim->debug_flags, sizeof(sim->debug_flags));
+            return;
+
+        case TapecartCommand_WriteDebugflags:
+            if(data_size == sizeof(sim->debug_flags))
+            {
+                sim->debug_flags = sim_read16(data);
+                result = CommandResult_Ok;
+            }
+            break;
+
+        case TapecartCommand_DirSetparams:
+            // Offset (24 bits), entry count, name length and data length
+            if(data_size == 7)
+            {
+                sim->dir_offset = sim_read24(data);
+                sim->dir_entries = sim_read16(data + 3);
+                sim->dir_name_length = data[5];
+                sim->dir_data_length = data[6];
+                result = CommandResult_Ok;
+            }
+            break;
+
+        case TapecartCommand_DirLookup:
+            sim_dir_lookup(sim, data, data_size);
+            return;
+
+        default:
+            result = CommandResult_NotImplemented;
+            break;
+    }
+
+    sim_send_response(sim, group, command, result);
+}
+
+// Receive one command the way the sketch does, with an ENQ handshake after
+// every handshake window of payload
+static bool sim_receive_command(Simulator *sim, SendCommandHeader *header)
+{
+    while(sim_read_bytes(sim, &header->prefix, 1, true))
+    {
+        if(header->prefix != CommandPrefix_SOH)
+        {
+            continue;   // Resync on the next command
+        }
+
+        if(!sim_read_bytes(sim, &header->group, sizeof(*header) - 1, false))
+        {
+            return false;
+        }
+
+        uint16_t received = 0;
+        while(received < header->length)
+        {
+            uint16_t window = sim->handshake_window;
+            uint16_t chunk_size = header->length - received > window ? window : header->length - received;
+            if(!sim_read_bytes(sim, sim->rx_buffer + received, chunk_size, false))
+            {
+                return false;
+            }
+
+            received += chunk_size;
+
+            if(header->length > window)
+            {
+                uint8_t handshake = CommandPrefix_ENQ;
+                sim_send_debug_output(sim);
+                sim_send_bytes(sim, &handshake, 1);
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+static void run_simulator(Simulator *sim)
+{
+    sim->random_state = sim->config.seed;
+
+    while(!sim->stop)
+    {
+        SendCommandHeader header;
+        if(!sim_receive_command(sim, &header))
+        {
+            continue;
+        }
+
+        uint8_t checksum = 0;
+        if(!sim_read_bytes(sim, &checksum, 1, false))
+        {
+            continue;
+        }
+
+        uint8_t calc_checksum = 0;
+        for(size_t i = 1; i < sizeof(header); i++)
+        {
+            calc_checksum ^= ((uint8_t *)&header)[i];
+        }
+        for(size_t i = 0; i < header.length; i++)
+        {
+            calc_checksum ^= sim->rx_buffer[i];
+        }
+
+        sim_delay(sim->config.command_delay_us);
+
+        if(calc_checksum != checksum)
+        {
+            sim_send_response(sim, header.group, header.command, CommandResult_ChecksumError);
+        }
+        else if(header.group == CommandGroup_Arduino)
+        {
+            sim_arduino_command(sim, header.command, sim->rx_buffer, header.length);
+        }
+        else if(header.group == CommandGroup_Tapecart)
+        {
+            sim_tapecart_command(sim, header.command, sim->rx_buffer, header.length);
+        }
+        else
+        {
+            sim_send_response(sim, header.group, header.command, CommandResult_NotImplemented);
+        }
+    }
+}
+
+static bool init_simulator(Simulator *sim, SimulatorConfig *config)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->config = *config;
+    sim->fd = -1;
+    sim->handshake_window = DEFAULT_HANDSHAKE_WINDOW;
+
+    if(config->flash_size == 0 || config->flash_size > 0xFFFFFF || config->page_size == 0 ||
+       sim_erase_block_size(sim) == 0 || config->flash_size % sim_erase_block_size(sim) != 0)
+    {
+        fprintf(stderr, "Invalid flash geometry\n");
+        return false;
+    }
+
+    sim->flash = (uint8_t *)malloc(config->flash_size);
+    if(!sim->flash)
+    {
+        fprintf(stderr, "Failed to allocate %u bytes of flash\n", config->flash_size);
+        return false;
+    }
+
+    memset(sim->flash, 0xFF, config->flash_size);
+    memset(&sim->loader, 0xFF, sizeof(sim->loader));
+
+    return true;
+}
+
+// Preload flash and header data from a TCRT file
+static bool load_simulator_image(Simulator *sim, char *path)
+{
+    bool result = false;
+
+    int file = open_file(path, O_RDONLY);
+    if(file != -1)
+    {
+        TcrtHeader header = {};
+        if(read_file(file, &header, sizeof(header)) &&
+           memcmp(header.file_signature, TCRT_FILE_SIGNATURE, sizeof(header.file_signature)) == 0 &&
+           header.flash_content_length <= sim->config.flash_size)
+        {
+            if(read_file(file, sim->flash, header.flash_content_length))
+            {
+                sim->loadinfo = header.loadinfo;
+                if(header.misc_flags & MiscFlags_InitialLoaderValid)
+                {
+                    sim->loader = header.initial_loader;
+                }
+
+                result = true;
+            }
+        }
+
+        close(file);
+    }
+
+    if(!result)
+    {
+        fprintf(stderr, "Failed to load TCRT file %s\n", path);
+    }
+
+    return result;
+}
+
+static void free_simulator(Simulator *sim)
+{
+    if(sim->fd != -1)
+    {
+        close(sim->fd);
+    }
+
+    free(sim->flash);
+}
@@ -0,0 +1,180 @@
+#include <time.h>
+#include <stdarg.h>
+
+#define STATS_HISTOGRAM_BUCKETS 128     // 4 buckets per power of two microseconds
+
+enum StatsPhase : uint8_t
+{
+    StatsPhase_Init = 0,
+    StatsPhase_Header,
+    StatsPhase_Erase,
+    StatsPhase_Write,
+    StatsPhase_Read,
+    StatsPhase_Crc,
+    StatsPhase_FileIo,
+    StatsPhase_Count
+};
+
+static const char *stats_phase_names[StatsPhase_Count] =
+{
+    "init", "header", "erase", "write", "read", "CRC", "file I/O"
+};
+
+struct CommandStats
+{
+    uint32_t count;
+    uint32_t failures;
+    uint64_t max_us;
+    uint32_t histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+struct Stats
+{
+    uint64_t start_us;
+    uint64_t phase_us[StatsPhase_Count];
+
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t file_bytes;
+    uint32_t checksum_errors;
+    uint32_t debug_bytes;
+    uint32_t retries;
+
+    CommandStats commands[0x200];   // Tapecart commands, then Arduino commands
+};
+
+static thread_local Stats stats;     // Per link, see merge_stats()
+
+#define LINK_LOG_SIZE 4096
+
+// Gang workers publish their progress and messages here instead of printing
+// them, the messages are shown below the result of their port
+struct LinkProgress
+{
+    uint32_t bytes_done;
+    uint32_t retried_blocks;
+    uint32_t failed_blocks;
+    bool finished;
+    uint32_t log_size;
+    char log[LINK_LOG_SIZE];
+};
+
+static thread_local LinkProgress *link_progress = NULL;
+
+__attribute__((format(printf, 2, 3)))
+static void print_link_message(FILE *stream, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if(link_progress)
+    {
+        // Later messages are dropped once the log is full
+        size_t free_size = sizeof(link_progress->log) - link_progress->log_size;
+        int length = vsnprintf(link_progress->log + link_progress->log_size, free_size, format, args);
+        if(length > 0)
+        {
+            link_progress->log_size += (size_t)length < free_size ? length : free_size - 1;
+        }
+    }
+    else
+    {
+        vfprintf(stream, format, args);
+    }
+
+    va_end(args);
+}
+
+static uint64_t get_time_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t get_time_ms()
+{
+    return get_time_us() / 1000;
+}
+
+static uint32_t get_histogram_bucket(uint64_t us)
+{
+    if(us < 4)
+    {
+        return (uint32_t)us;
+    }
+
+    uint32_t octave = 63 - __builtin_clzll(us);
+    uint32_t bucket = octave * 4 + ((us >> (octave - 2)) & 3);
+
+    return bucket < STATS_HISTOGRAM_BUCKETS ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value that falls into a bucket
+static uint64_t get_histogram_limit(uint32_t bucket)
+{
+    if(bucket < 4)
+    {
+        return bucket;
+    }
+
+    uint32_t octave = bucket / 4;
+    return ((uint64_t)(4 + (bucket & 3) + 1) << (octave - 2)) - 1;
+}
+
+static uint64_t get_histogram_percentile(CommandStats *command_stats, uint32_t percent)
+{
+    uint64_t target = ((uint64_t)command_stats->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for(uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += command_stats->histogram[i];
+        if(seen >= target && seen > 0)
+        {
+            uint64_t limit = get_histogram_limit(i);
+            return limit < command_stats->max_us ? limit : command_stats->max_us;
+        }
+    }
+
+    return command_stats->max_us;
+}
+
+static void add_phase_time(StatsPhase phase, uint64_t us)
+{
+    stats.phase_us[phase] += us;
+}
+
+// Add up the statistics of several links, e.g. from gang mode workers
+static void merge_stats(Stats *total, Stats *link_stats)
+{
+    for(int i = 0; i < StatsPhase_Count; i++)
+    {
+        total->phase_us[i] += link_stats->phase_us[i];
+    }
+
+    total->bytes_sent += link_stats->bytes_sent;
+    total->bytes_received += link_stats->bytes_received;
+    total->file_bytes += link_stats->file_bytes;
+    total->checksum_errors += link_stats->checksum_errors;
+    total->debug_bytes += link_stats->debug_bytes;
+    total->retries += link_stats->retries;
+
+    for(uint32_t i = 0; i < sizeof(total->commands) / sizeof(total->commands[0]); i++)
+    {
+        CommandStats *command_total = &total->commands[i];
+        CommandStats *command_stats = &link_stats->commands[i];
+
+        command_total->count += command_stats->count;
+        command_total->failures += command_stats->failures;
+        if(command_stats->max_us > command_total->max_us)
+        {
+            command_total->max_us = command_stats->max_us;
+        }
+
+        for(uint32_t j = 0; j < STATS_HISTOGRAM_BUCKETS; j++)
+        {
+            command_total->histogram[j] += command_stats->histogram[j];
+        }
+    }
+}
@@ -0,0 +1,333 @@
+// Throughput and latency benchmark. Runs the flasher commands against an
+// in-process simulator on a PTY and compares the results with a baseline.
+
+#define TAPECART_FLASHER_NO_MAIN
+#include "tapecart_flasher.cpp"
+#include <pthread.h>
+#include "simulator.cpp"
+
+#define BENCH_FLASH_SIZE (256*1024)
+#define BENCH_BYTE_DELAY_US 10      // Roughly 1 Mbaud
+#define BENCH_COMMAND_DELAY_US 200
+#define BENCH_MAX_SAMPLES 0x10000
+#define BENCH_DEFAULT_THRESHOLD 20.0
+#define BENCH_MIN_SLOWDOWN 0.05     // Seconds, ignore timing noise on short operations
+
+struct BenchOperation
+{
+    const char *name;
+    bool (*command)(int);
+    bool diff;
+    uint32_t bytes;
+};
+
+struct BenchResult
+{
+    double seconds;
+    uint32_t commands;
+    uint32_t failed_commands;
+    uint32_t rtt_p50_us;
+    uint32_t rtt_p90_us;
+    uint32_t rtt_p99_us;
+    uint32_t rtt_max_us;
+};
+
+static Simulator simulator;
+static uint32_t rtt_samples[BENCH_MAX_SAMPLES];
+static uint32_t rtt_sample_count;
+static uint32_t failed_command_count;
+
+static void record_command(CommandGroup group, uint8_t command, uint64_t round_trip_us, bool result)
+{
+    if(rtt_sample_count < BENCH_MAX_SAMPLES)
+    {
+        rtt_samples[rtt_sample_count++] = (uint32_t)round_trip_us;
+    }
+
+    if(!result)
+    {
+        failed_command_count++;
+    }
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t get_percentile(uint32_t *samples, uint32_t count, uint32_t percent)
+{
+    if(count == 0)
+    {
+        return 0;
+    }
+
+    uint32_t index = (count * percent + 99) / 100;
+    return samples[index ? index - 1 : 0];
+}
+
+static void *simulator_thread(void *arg)
+{
+    run_simulator((Simulator *)arg);
+    return NULL;
+}
+
+// Mostly padding with some code at the start and a few scattered blocks,
+// like a typical image
+static bool write_bench_image(int file)
+{
+    TcrtHeader header = {};
+    memcpy(header.file_signature, TCRT_FILE_SIGNATURE, sizeof(header.file_signature));
+    header.version_number = TCRT_VERSION;
+    header.misc_flags = MiscFlags_InitialLoaderValid;
+    header.flash_content_length = BENCH_FLASH_SIZE;
+    memcpy(header.loadinfo.filename, "BENCHMARK       ", sizeof(header.loadinfo.filename));
+
+    uint8_t *data = (uint8_t *)malloc(BENCH_FLASH_SIZE);
+    uint32_t seed = 1;
+
+    memset(data, 0xFF, BENCH_FLASH_SIZE);
+    for(uint32_t i = 0; i < BENCH_FLASH_SIZE; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        if(i < BENCH_FLASH_SIZE / 4 || (i % 0x10000) < 0x400)
+        {
+            data[i] = seed >> 16;
+        }
+    }
+
+    bool result = write_file(file, &header, sizeof(header)) && write_file(file, data, BENCH_FLASH_SIZE);
+    free(data);
+
+    return result;
+}
+
+static bool run_operation(BenchOperation *operation, char *device, BenchResult *bench_result)
+{
+    bool result = false;
+
+    rtt_sample_count = 0;
+    failed_command_count = 0;
+    diff_flash = operation->diff;
+
+    // Keep the progress output of the commands out of the report
+    fflush(stdout);
+    int stdout_copy = dup(STDOUT_FILENO);
+    int null_fd = open_file((char *)"/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    uint64_t start_us = get_time_us();
+
+    int fd = open_serial_port(device);
+    if(fd != -1)
+    {
+        if(setup_serial_port(fd, DEFAULT_BAUD_RATE) && init_tapecart(fd, false))
+        {
+            result = operation->command(fd);
+        }
+
+        close(fd);
+    }
+
+    bench_result->seconds = (get_time_us() - start_us) / 1e6;
+
+    fflush(stdout);
+    dup2(stdout_copy, STDOUT_FILENO);
+    close(stdout_copy);
+
+    qsort(rtt_samples, rtt_sample_count, sizeof(rtt_samples[0]), compare_samples);
+    bench_result->commands = rtt_sample_count;
+    bench_result->failed_commands = failed_command_count;
+    bench_result->rtt_p50_us = get_percentile(rtt_samples, rtt_sample_count, 50);
+    bench_result->rtt_p90_us = get_percentile(rtt_samples, rtt_sample_count, 90);
+    bench_result->rtt_p99_us = get_percentile(rtt_samples, rtt_sample_count, 99);
+    bench_result->rtt_max_us = rtt_sample_count ? rtt_samples[rtt_sample_count - 1] : 0;
+
+    return result;
+}
+
+// Baseline lines are "<operation> <seconds> <commands>", # starts a comment
+static bool find_baseline(FILE *baseline, const char *name, double *seconds, uint32_t *commands)
+{
+    char line[256];
+    rewind(baseline);
+
+    while(fgets(line, sizeof(line), baseline))
+    {
+        char op[64];
+        if(line[0] != '#' && sscanf(line, "%63s %lf %u", op, seconds, commands) == 3 && strcmp(op, name) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    char *baseline_filename = NULL;
+    char *write_baseline_filename = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    bool valid_options = true;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baseline_filename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc)
+        {
+            write_baseline_filename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+        {
+            threshold = atof(argv[++i]);
+        }
+        else
+        {
+            valid_options = false;
+        }
+    }
+
+    if(!valid_options)
+    {
+        fprintf(stderr, "Usage: %s [--baseline <file>] [--threshold <percent>] [--write-baseline <file>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char image_filename[] = "/tmp/tapecart_bench_image_XXXXXX";
+    char dump_filename[] = "/tmp/tapecart_bench_dump_XXXXXX";
+    int image_file = mkstemp(image_filename);
+    int dump_file = mkstemp(dump_filename);
+
+    if(image_file == -1 || dump_file == -1 || !write_bench_image(image_file))
+    {
+        fprintf(stderr, "Failed to create benchmark files. %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    close(image_file);
+    close(dump_file);
+
+    SimulatorConfig config;
+    init_simulator_config(&config);
+    config.flash_size = BENCH_FLASH_SIZE;
+    config.byte_delay_us = BENCH_BYTE_DELAY_US;
+    config.command_delay_us = BENCH_COMMAND_DELAY_US;
+
+    char device[64];
+    pthread_t thread;
+    int result = EXIT_FAILURE;
+
+    if(init_simulator(&simulator, &config) &&
+       (simulator.fd = open_simulator_pty(device, sizeof(device))) != -1 &&
+       pthread_create(&thread, NULL, simulator_thread, &simulator) == 0)
+    {
+        BenchOperation operations[] =
+        {
+            { "info",       info_command,           false,  0 },
+            { "flash",      flash_tcrt_command,     false,  BENCH_FLASH_SIZE },
+            { "validate",   validate_tcrt_command,  false,  BENCH_FLASH_SIZE },
+            { "dump",       dump_tcrt_command,      false,  BENCH_FLASH_SIZE },
+            { "flash-diff", flash_tcrt_command,     true,   BENCH_FLASH_SIZE },
+        };
+
+        FILE *baseline = baseline_filename ? fopen(baseline_filename, "r") : NULL;
+        FILE *write_baseline = write_baseline_filename ? fopen(write_baseline_filename, "w") : NULL;
+        uint32_t regressions = 0;
+
+        if(baseline_filename && !baseline)
+        {
+            fprintf(stderr, "Failed to open %s. %s\n", baseline_filename, strerror(errno));
+        }
+        if(write_baseline)
+        {
+            fprintf(write_baseline, "# Generated by tapecart_bench --write-baseline\n");
+            fprintf(write_baseline, "# operation seconds commands\n");
+        }
+
+        command_observer = record_command;
+        result = EXIT_SUCCESS;
+
+        printf("Flash %u bytes, %u us per byte, %u us per command\n",
+               BENCH_FLASH_SIZE, BENCH_BYTE_DELAY_US, BENCH_COMMAND_DELAY_US);
+        printf("%-10s %8s %10s %8s %8s %8s %8s %8s %8s\n", "operation", "seconds", "bytes/s",
+               "commands", "cmds/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+
+        for(size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++)
+        {
+            BenchOperation *operation = &operations[i];
+            BenchResult bench_result = {};
+
+            filename = operation->command == dump_tcrt_command ? dump_filename : image_filename;
+            if(!run_operation(operation, device, &bench_result))
+            {
+                fprintf(stderr, "%s failed\n", operation->name);
+                result = EXIT_FAILURE;
+                continue;
+            }
+
+            printf("%-10s %8.3f %10.0f %8u %8.0f %8.2f %8.2f %8.2f %8.2f",
+                   operation->name, bench_result.seconds, operation->bytes / bench_result.seconds,
+                   bench_result.commands, bench_result.commands / bench_result.seconds,
+                   bench_result.rtt_p50_us / 1000.0, bench_result.rtt_p90_us / 1000.0,
+                   bench_result.rtt_p99_us / 1000.0, bench_result.rtt_max_us / 1000.0);
+
+            double baseline_seconds;
+            uint32_t baseline_commands;
+            if(baseline && find_baseline(baseline, operation->name, &baseline_seconds, &baseline_commands))
+            {
+                if((bench_result.seconds > baseline_seconds * (1 + threshold / 100) &&
+                    bench_result.seconds > baseline_seconds + BENCH_MIN_SLOWDOWN) ||
+                   bench_result.commands > baseline_commands * (1 + threshold / 100))
+                {
+                    printf("  REGRESSION (baseline %.3f s, %u commands)", baseline_seconds, baseline_commands);
+                    regressions++;
+                }
+            }
+            printf("\n");
+
+            if(write_baseline)
+            {
+                fprintf(write_baseline, "%s %.3f %u\n", operation->name, bench_result.seconds, bench_result.commands);
+            }
+        }
+
+        if(baseline)
+        {
+            printf("%u regressions beyond %.0f%% of %s\n", regressions, threshold, baseline_filename);
+            fclose(baseline);
+
+            if(regressions)
+            {
+                result = EXIT_FAILURE;
+            }
+        }
+        else if(baseline_filename)
+        {
+            result = EXIT_FAILURE;
+        }
+
+        if(write_baseline)
+        {
+            fclose(write_baseline);
+        }
+
+        simulator.stop = true;
+        pthread_join(thread, NULL);
+    }
+    else
+    {
+        fprintf(stderr, "Failed to start simulator. %s\n", strerror(errno));
+    }
+
+    free_simulator(&simulator);
+    unlink(image_filename);
+    unlink(dump_filename);
+
+    return result;
+}
@@ -4,49 +4,147 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stddef.h>
+#include "stats.cpp"
 #include "file_io.cpp"
 #include "serial_port.cpp"
 #include "commands.cpp"
+#include "crc32.cpp"
+#include "compression.cpp"
+#include "journal.cpp"
 #include "tcrt_file.cpp"
+#include "archive.cpp"
+#include <pthread.h>
+#include <glob.h>
+
+#define GANG_PROGRESS_INTERVAL_MS 250
 
 static char *filename;
+static char *reference_filename = NULL;
+static uint32_t baud_rate = DEFAULT_BAUD_RATE;
+static bool auto_baud_rate = false;
+static thread_local ArduinoSketchVersion sketch_version;   // Set by init_tapecart()
+
+// Candidate rates for --baud auto, tried in increasing order
+static const uint32_t auto_baud_rates[] =
+{
+    230400, 250000, 460800, 500000, 921600, 1000000, 1500000, 2000000
+};
+
+// Step up through auto_baud_rates while the sketch switches along and answers
+// at the new rate. Sketches before BAUD_RATE_API_VERSION cannot switch and
+// stay at the current rate. If the sketch does not hear the probe at a new
+// rate, it goes back by itself after BAUD_RATE_CONFIRM_MS, so the host does
+// the same and settles on the last rate that worked.
+static bool negotiate_baud_rate(int fd, ArduinoSketchVersion *version)
+{
+    uint32_t current_rate = serial_baud_rate;
+
+    if(version->api_version < BAUD_RATE_API_VERSION)
+    {
+        print_link_message(stdout, "Sketch API v%u cannot change its baud rate, using %u baud\n",
+                version->api_version, current_rate);
+        return true;
+    }
+
+    for(size_t i = 0; i < sizeof(auto_baud_rates) / sizeof(auto_baud_rates[0]); i++)
+    {
+        uint32_t accepted_rate = 0;
+        ArduinoSketchVersion probe_version;
+
+        if(auto_baud_rates[i] <= current_rate)
+        {
+            continue;
+        }
+
+        if(!set_sketch_baud_rate(fd, auto_baud_rates[i], &accepted_rate))
+        {
+            return false;
+        }
+
+        if(accepted_rate != auto_baud_rates[i])
+        {
+            continue;   // Not supported by the sketch, it stays at the current rate
+        }
+
+        if(set_serial_speed(fd, accepted_rate))
+        {
+            discard_rx_buffer(fd);
+            if(get_sketch_version(fd, &probe_version))
+            {
+                current_rate = accepted_rate;
+                continue;
+            }
+        }
+
+        if(!set_serial_speed(fd, current_rate))
+        {
+            print_link_message(stderr, "Failed to restore %u baud. %s\n", current_rate, strerror(errno));
+            return false;
+        }
+
+        usleep(BAUD_RATE_CONFIRM_MS * 1000);
+        discard_rx_buffer(fd);
+        if(!get_sketch_version(fd, &probe_version))
+        {
+            print_link_message(stderr, "Arduino did not return to %u baud\n", current_rate);
+            return false;
+        }
+        break;
+    }
+
+    print_link_message(stdout, "Using %u baud\n", current_rate);
+    return true;
+}
+
+static void print_arduino_version()
+{
+    print_link_message(stdout, "Arduino type %u Sketch v%u.%u/%u\n", sketch_version.arduino_type,
+           sketch_version.major_version, sketch_version.minor_version, sketch_version.api_version);
+}
 
 static bool init_tapecart(int fd, bool print_sketch_version)
 {
     bool result = false;
+    discard_rx_buffer(fd);  // Start from a clean stream, later commands resync on demand
 
-    ArduinoSketchVersion sketch_version;
     if(get_sketch_version(fd, &sketch_version))
     {
-        if(sketch_version.api_version < SUPPORTED_API_VERSION)
+        if(sketch_version.api_version < OLDEST_API_VERSION)
         {
-            fprintf(stderr, "Warning: Sketch uses old API v%u, newest supported is v%u\n",
-                    sketch_version.api_version, SUPPORTED_API_VERSION);
+            print_link_message(stderr, "Warning: Sketch uses old API v%u, oldest supported is v%u\n",
+                    sketch_version.api_version, OLDEST_API_VERSION);
         }
         else if(sketch_version.api_version > SUPPORTED_API_VERSION)
         {
-            fprintf(stderr, "Warning: Sketch uses unknown API v%u, newest supported is v%u\n",
+            print_link_message(stderr, "Warning: Sketch uses unknown API v%u, newest supported is v%u\n",
                     sketch_version.api_version, SUPPORTED_API_VERSION);
         }
 
         if(print_sketch_version)
         {
-            printf("Arduino type %u Sketch v%u.%u/%u\n", sketch_version.arduino_type,
-                   sketch_version.major_version, sketch_version.minor_version, sketch_version.api_version);
+            print_arduino_version();
         }
 
+        if(auto_baud_rate && !negotiate_baud_rate(fd, &sketch_version))
+        {
+            print_link_message(stderr, "Failed to change baud rate\n");
+            return false;
+        }
+
+        negotiate_handshake_window(fd, &sketch_version);
+
         if(send_arduino_command(fd, ArduinoCommand_StartCommandMode))
         {
             result = true;
         }
         else
         {
-            fprintf(stderr, "Failed to connect to Tapecart\n");
+            print_link_message(stderr, "Failed to connect to Tapecart\n");
         }
     }
     else
     {
-        fprintf(stderr, "Failed to connect to Arduino\n");
+        print_link_message(stderr, "Failed to connect to Arduino\n");
     }
 
     return result;
@@ -106,7 +204,13 @@ static bool reset_command(int fd)
 
         printf("Arduino reset\n");
 
+        // Print boot messages until the Arduino has been quiet for a while
+        do
+        {
+            set_serial_deadline(DEFAULT_TIMEOUT_MS);
+        }
         while(receive_debug_output(fd));
+
         return true;
     }
 
@@ -138,32 +242,61 @@ static bool led_off_command(int fd)
     return false;
 }
 
-static bool dump_tcrt_command(int fd)
+static bool load_image(char *name, TcrtImage *image)
 {
     bool result = false;
 
-    int file = open_file(filename, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    int file = open_file(name, O_RDONLY);
     if(file != -1)
     {
-        result = dump_tcrt_to_file(fd, file);
+        result = load_tcrt_image(file, image);
         close(file);
     }
     else
     {
-        fprintf(stderr, "Failed to open %s. %s\n", filename, strerror(errno));
+        fprintf(stderr, "Failed to open %s. %s\n", name, strerror(errno));
     }
 
     return result;
 }
 
-static bool flash_tcrt_command(int fd)
+static bool dump_tcrt_command(int fd)
 {
-    bool result = false;    
+    bool result = false;
+    TcrtImage reference;
 
-    int file = open_file(filename, O_RDONLY);
+    if(compress_dump && (sparse_dump || resume_journal))
+    {
+        fprintf(stderr, "A compressed dump cannot be sparse or resumed\n");
+        return false;
+    }
+
+    if(reference_filename && !load_image(reference_filename, &reference))
+    {
+        return false;
+    }
+
+    // Truncated only after the check below, the reference may be the same file.
+    // Keep what an interrupted dump already read when resuming.
+    int file = open_file(filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
     if(file != -1)
     {
-        result = flash_tcrt_file(fd, file);
+        struct stat file_stat, reference_stat;
+
+        if(reference_filename && fstat(file, &file_stat) == 0 && stat(reference_filename, &reference_stat) == 0 &&
+           file_stat.st_dev == reference_stat.st_dev && file_stat.st_ino == reference_stat.st_ino)
+        {
+            fprintf(stderr, "The dump cannot overwrite its reference %s\n", reference_filename);
+        }
+        else if(!resume_journal && ftruncate(file, 0) != 0)
+        {
+            fprintf(stderr, "Failed to truncate %s. %s\n", filename, strerror(errno));
+        }
+        else
+        {
+            result = dump_tcrt_to_file(fd, file, filename, reference_filename ? &reference : NULL);
+        }
+
         close(file);
     }
     else
@@ -171,108 +304,583 @@ static bool flash_tcrt_command(int fd)
         fprintf(stderr, "Failed to open %s. %s\n", filename, strerror(errno));
     }
 
+    if(reference_filename)
+    {
+        free_tcrt_image(&reference);
+    }
+
+    return result;
+}
+
+static bool flash_tcrt_command(int fd)
+{
+    bool result = false;
+    TcrtImage image;
+
+    if(load_image(filename, &image))
+    {
+        result = flash_tcrt_file(fd, &image, filename);
+        free_tcrt_image(&image);
+    }
+
     return result;
 }
 
 static bool validate_tcrt_command(int fd)
 {
     bool result = false;
+    TcrtImage image;
 
-    int file = open_file(filename, O_RDONLY);
-    if(file != -1)
+    if(load_image(filename, &image))
     {
-        result = validate_tcrt_file(fd, file);
-        close(file);
+        result = validate_tcrt_file(fd, &image, filename);
+        free_tcrt_image(&image);
+    }
+
+    return result;
+}
+
+static bool archive_command(int fd)
+{
+    return archive_tcrt(fd, filename);
+}
+
+static StatsPhase get_command_phase(CommandGroup group, uint8_t command)
+{
+    if(group == CommandGroup_Arduino)
+    {
+        return StatsPhase_Init;
+    }
+
+    switch(command)
+    {
+        case TapecartCommand_EraseFlashBlock:
+        case TapecartCommand_EraseFlash64K:
+            return StatsPhase_Erase;
+
+        case TapecartCommand_WriteFlash:
+        case TapecartCommand_WriteFlashFast:
+            return StatsPhase_Write;
+
+        case TapecartCommand_ReadFlash:
+        case TapecartCommand_ReadFlashFast:
+            return StatsPhase_Read;
+
+        case TapecartCommand_Crc32Flash:
+            return StatsPhase_Crc;
+
+        case TapecartCommand_ReadLoader:
+        case TapecartCommand_WriteLoader:
+        case TapecartCommand_ReadLoadinfo:
+        case TapecartCommand_WriteLoadinfo:
+        case TapecartCommand_ReadDevicesizes:
+        case TapecartCommand_ReadDeviceinfo:
+            return StatsPhase_Header;
+
+        default:
+            return StatsPhase_Init;
+    }
+}
+
+static void record_command_stats(CommandGroup group, uint8_t command, uint64_t round_trip_us, bool result)
+{
+    CommandStats *command_stats = &stats.commands[(group == CommandGroup_Arduino ? 0x100 : 0) + command];
+
+    command_stats->count++;
+    command_stats->histogram[get_histogram_bucket(round_trip_us)]++;
+    if(round_trip_us > command_stats->max_us)
+    {
+        command_stats->max_us = round_trip_us;
+    }
+    if(!result)
+    {
+        command_stats->failures++;
+    }
+
+    add_phase_time(get_command_phase(group, command), round_trip_us);
+}
+
+// Phase times of several links add up, so they are compared with the wall
+// time of all links together
+static void print_stats(uint32_t links)
+{
+    uint64_t wall_us = get_time_us() - stats.start_us;
+    uint64_t total_us = wall_us * links;
+    uint64_t accounted_us = 0;
+
+    printf("\nStatistics\n");
+    if(links > 1)
+    {
+        printf("    %-20s %10u\n", "links", links);
+    }
+    printf("    %-20s %10.3f s\n", "total", wall_us / 1e6);
+    for(int i = 0; i < StatsPhase_Count; i++)
+    {
+        printf("    %-20s %10.3f s %5.1f%%\n", stats_phase_names[i], stats.phase_us[i] / 1e6,
+               total_us ? stats.phase_us[i] * 100.0 / total_us : 0.0);
+        accounted_us += stats.phase_us[i];
+    }
+
+    uint64_t other_us = total_us > accounted_us ? total_us - accounted_us : 0;
+    printf("    %-20s %10.3f s %5.1f%%\n", "other", other_us / 1e6,
+           total_us ? other_us * 100.0 / total_us : 0.0);
+
+    printf("\n    %-20s %8s %8s %10s %10s %10s\n", "command", "count", "failed", "p50 ms", "p99 ms", "max ms");
+    for(uint32_t i = 0; i < sizeof(stats.commands) / sizeof(stats.commands[0]); i++)
+    {
+        CommandStats *command_stats = &stats.commands[i];
+        if(command_stats->count)
+        {
+            CommandGroup group = i < 0x100 ? CommandGroup_Tapecart : CommandGroup_Arduino;
+            printf("    %-20s %8u %8u %10.2f %10.2f %10.2f\n", get_command_name(group, i & 0xFF),
+                   command_stats->count, command_stats->failures,
+                   get_histogram_percentile(command_stats, 50) / 1000.0,
+                   get_histogram_percentile(command_stats, 99) / 1000.0,
+                   command_stats->max_us / 1000.0);
+        }
+    }
+
+    double seconds = wall_us ? wall_us / 1e6 : 1;
+    printf("\n    %-20s %10llu bytes %10.0f bytes/s\n", "sent", (unsigned long long)stats.bytes_sent,
+           stats.bytes_sent / seconds);
+    printf("    %-20s %10llu bytes %10.0f bytes/s\n", "received", (unsigned long long)stats.bytes_received,
+           stats.bytes_received / seconds);
+    printf("    %-20s %10llu bytes\n", "file", (unsigned long long)stats.file_bytes);
+    printf("    %-20s %10u\n", "checksum errors", stats.checksum_errors);
+    printf("    %-20s %10u bytes\n", "debug output", stats.debug_bytes);
+    printf("    %-20s %10u\n", "block retries", stats.retries);
+}
+
+// Gang mode, one worker thread per port, all flashing the same image
+
+struct GangLink
+{
+    char *device;
+    char journal_name[PATH_MAX];
+    pthread_t thread;
+    LinkProgress progress;
+    bool result;
+};
+
+typedef bool (*GangCommand)(int fd, TcrtImage *image, const char *journal_name);
+
+static TcrtImage gang_image;
+static GangCommand gang_command;
+static Stats gang_stats;
+static pthread_mutex_t gang_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool is_device_list(char *device)
+{
+    return strpbrk(device, ",*?[") != NULL;
+}
+
+// Expand a comma separated list of devices and glob patterns
+static bool expand_device_list(char *device_list, glob_t *devices)
+{
+    int flags = GLOB_NOCHECK;
+
+    for(char *pattern = strtok(device_list, ","); pattern; pattern = strtok(NULL, ","))
+    {
+        if(glob(pattern, flags, NULL, devices) != 0)
+        {
+            return false;
+        }
+
+        flags |= GLOB_APPEND;
+    }
+
+    return devices->gl_pathc > 0;
+}
+
+static void *gang_worker(void *arg)
+{
+    GangLink *link = (GangLink *)arg;
+    link_progress = &link->progress;
+
+    int fd = open_serial_port(link->device);
+    if(fd != -1)
+    {
+        if(setup_serial_port(fd, baud_rate))
+        {
+            if(init_tapecart(fd, false))
+            {
+                link->result = gang_command(fd, &gang_image, link->journal_name);
+            }
+        }
+        else
+        {
+            print_link_message(stderr, "Failed to setup serial port %s. %s\n", link->device, strerror(errno));
+        }
+
+        close(fd);
     }
     else
     {
-        fprintf(stderr, "Failed to open %s. %s\n", filename, strerror(errno));
+        print_link_message(stderr, "Failed to open %s. %s\n", link->device, strerror(errno));
+    }
+
+    pthread_mutex_lock(&gang_stats_mutex);
+    merge_stats(&gang_stats, &stats);
+    pthread_mutex_unlock(&gang_stats_mutex);
+
+    __atomic_store_n(&link->progress.finished, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void print_gang_progress(const char *action, GangLink *links, uint32_t link_count, uint32_t link_size)
+{
+    uint64_t bytes_done = 0;
+    uint32_t finished = 0;
+
+    for(uint32_t i = 0; i < link_count; i++)
+    {
+        if(__atomic_load_n(&links[i].progress.finished, __ATOMIC_ACQUIRE))
+        {
+            bytes_done += link_size;
+            finished++;
+        }
+        else
+        {
+            bytes_done += __atomic_load_n(&links[i].progress.bytes_done, __ATOMIC_RELAXED);
+        }
+    }
+
+    double percent = link_size ? (100.0 / ((uint64_t)link_size * link_count)) * bytes_done : 100.0;
+    printf("\r%s %u ports [%.1f%%] %u finished ", action, link_count, percent, finished);
+    fflush(stdout);
+}
+
+static bool run_gang(glob_t *devices, bool validate)
+{
+    if(!load_image(filename, &gang_image))
+    {
+        return false;
+    }
+
+    uint32_t link_count = devices->gl_pathc;
+    uint32_t link_size = ((TcrtHeader *)gang_image.data)->flash_content_length;
+    GangLink *links = (GangLink *)calloc(link_count, sizeof(GangLink));
+    const char *action = validate ? "Validating" : "Flashing";
+    uint32_t started = 0;
+
+    gang_command = validate ? validate_tcrt_file : flash_tcrt_file;
+
+    for(uint32_t i = 0; i < link_count; i++, started++)
+    {
+        GangLink *link = &links[i];
+        link->device = devices->gl_pathv[i];
+
+        // Each port keeps its own journal next to the image
+        char *device_name = strrchr(link->device, '/');
+        snprintf(link->journal_name, sizeof(link->journal_name), "%s.%s", filename,
+                 device_name ? device_name + 1 : link->device);
+
+        if(pthread_create(&link->thread, NULL, gang_worker, link) != 0)
+        {
+            fprintf(stderr, "Failed to start worker for %s. %s\n", link->device, strerror(errno));
+            break;
+        }
+    }
+
+    bool finished = false;
+    while(!finished)
+    {
+        usleep(GANG_PROGRESS_INTERVAL_MS * 1000);
+        print_gang_progress(action, links, started, link_size);
+
+        finished = true;
+        for(uint32_t i = 0; i < started; i++)
+        {
+            finished = finished && __atomic_load_n(&links[i].progress.finished, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    printf("\n");
+
+    bool result = started == link_count;
+    for(uint32_t i = 0; i < started; i++)
+    {
+        GangLink *link = &links[i];
+        pthread_join(link->thread, NULL);
+
+        printf("    %-24s %s", link->device, link->result ? "OK" : "FAILED");
+        if(link->progress.retried_blocks || link->progress.failed_blocks)
+        {
+            printf(" (%u blocks retried, %u failed)", link->progress.retried_blocks, link->progress.failed_blocks);
+        }
+        printf("\n");
+
+        // Messages of the worker, indented below the result of its port
+        char *line = link->progress.log;
+        while(*line)
+        {
+            char *line_end = strchrnul(line, '\n');
+            printf("        %.*s\n", (int)(line_end - line), line);
+            line = *line_end ? line_end + 1 : line_end;
+        }
+
+        result = result && link->result;
     }
 
+    merge_stats(&stats, &gang_stats);
+    free(links);
+    free_tcrt_image(&gang_image);
+
     return result;
 }
 
+#include "daemon.cpp"    // Runs the commands above for its clients
+
+#ifndef TAPECART_FLASHER_NO_MAIN
 int main(int argc, char** argv)
 {
     bool (*command)(int) = NULL;
     bool skip_init_tapecart = false;
     bool print_sketch_version = false;
+    bool valid_options = true;
+    bool print_statistics = false;
+
+    char *args[4] = {};
+    int arg_count = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--diff") == 0)
+        {
+            diff_flash = true;
+        }
+        else if(strcmp(argv[i], "--verify") == 0)
+        {
+            verify_flash = true;
+        }
+        else if(strcmp(argv[i], "--sparse") == 0)
+        {
+#ifdef SPARSE_DUMP_SUPPORTED
+            sparse_dump = true;
+#else
+            fprintf(stderr, "--sparse is only supported on Linux\n");
+            valid_options = false;
+#endif
+        }
+        else if(strcmp(argv[i], "--compress") == 0)
+        {
+            compress_dump = true;
+        }
+        else if(strcmp(argv[i], "--reference") == 0 && i + 1 < argc)
+        {
+            reference_filename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--store") == 0 && i + 1 < argc)
+        {
+            store_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        {
+            socket_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--retries") == 0 && i + 1 < argc)
+        {
+            char *end;
+            i++;
+            block_retries = strtoul(argv[i], &end, 10);
+            valid_options = valid_options && end != argv[i] && *end == '\0';
+        }
+        else if(strcmp(argv[i], "--resume") == 0)
+        {
+            resume_journal = true;
+        }
+        else if(strcmp(argv[i], "--stats") == 0)
+        {
+            print_statistics = true;
+        }
+        else if(strcmp(argv[i], "--baud") == 0 && i + 1 < argc)
+        {
+            char *end;
+            i++;
+
+            if(strcmp(argv[i], "auto") == 0)
+            {
+                auto_baud_rate = true;
+            }
+            else
+            {
+                baud_rate = strtoul(argv[i], &end, 10);
+                valid_options = valid_options && *end == '\0' && baud_rate != 0;
+            }
+        }
+        else if(strncmp(argv[i], "--", 2) != 0 && arg_count < 4)
+        {
+            args[arg_count++] = argv[i];
+        }
+        else
+        {
+            valid_options = false;
+        }
+    }
+
+    // Archive commands that work on the store only, without a device
+    if(valid_options && arg_count >= 1 && (strcmp(args[0], "restore") == 0 || strcmp(args[0], "gc") == 0))
+    {
+        if(!store_path)
+        {
+            fprintf(stderr, "No archive store given, use --store <dir>\n");
+            return EXIT_FAILURE;
+        }
+
+        if(strcmp(args[0], "restore") == 0 && arg_count == 3)
+        {
+            return restore_tcrt(args[1], args[2]) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if(strcmp(args[0], "gc") == 0 && arg_count == 1)
+        {
+            return collect_garbage() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        valid_options = false;
+    }
+
+    if(valid_options && arg_count == 2 && strcmp(args[1], "daemon") == 0)
+    {
+        return run_daemon(args[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    if(argc == 3)
-    {       
-        if(strcmp(argv[2], "info") == 0)
+    if(valid_options && arg_count == 2)
+    {
+        if(strcmp(args[1], "info") == 0)
         {
             command = info_command;
             print_sketch_version = true;
         }
-        else if(strcmp(argv[2], "reset") == 0)
+        else if(strcmp(args[1], "reset") == 0)
         {
             command = reset_command;
             skip_init_tapecart = true;
         }
     }
-    else if(argc == 4)
+    else if(valid_options && arg_count == 3)
     {
-        if(strcmp(argv[2], "led") == 0)
+        if(strcmp(args[1], "led") == 0)
         {
-            if(strcmp(argv[3], "on") == 0)
+            if(strcmp(args[2], "on") == 0)
             {
                 command = led_on_command;
             }
-            else if(strcmp(argv[3], "off") == 0)
+            else if(strcmp(args[2], "off") == 0)
             {
                 command = led_off_command;
             }
         }
-        else if(strcmp(argv[2], "dump") == 0)
+        else if(strcmp(args[1], "dump") == 0)
         {
             command = dump_tcrt_command;
-            filename = argv[3];
+            filename = args[2];
         }
-        else if(strcmp(argv[2], "flash") == 0)
+        else if(strcmp(args[1], "flash") == 0)
         {
             command = flash_tcrt_command;
-            filename = argv[3];
+            filename = args[2];
         }
-        else if(strcmp(argv[2], "validate") == 0)
+        else if(strcmp(args[1], "validate") == 0)
         {
             command = validate_tcrt_command;
-            filename = argv[3];
+            filename = args[2];
+        }
+        else if(strcmp(args[1], "archive") == 0 && store_path)
+        {
+            command = archive_command;
+            filename = args[2];
         }
     }
 
     int result = EXIT_FAILURE;
     if(command)
     {
-        int fd = open_serial_port(argv[1]);
-        if(fd != -1)
+        if(print_statistics)
+        {
+            stats.start_us = get_time_us();
+            command_observer = record_command_stats;
+        }
+
+        if(command == dump_tcrt_command || command == flash_tcrt_command || command == validate_tcrt_command ||
+           command == archive_command)
+        {
+            // Finish the current block and keep the journal on Ctrl-C
+            signal(SIGINT, interrupt_handler);
+        }
+
+        uint32_t links = 1;
+        if(is_device_list(args[0]))
         {
-            if(setup_serial_port(fd))
+            glob_t devices = {};
+
+            if(command != flash_tcrt_command && command != validate_tcrt_command)
             {
-                if(skip_init_tapecart || init_tapecart(fd, print_sketch_version))
+                fprintf(stderr, "Only flash and validate can run on several devices\n");
+            }
+            else if(!expand_device_list(args[0], &devices))
+            {
+                fprintf(stderr, "No devices found\n");
+            }
+            else
+            {
+                links = devices.gl_pathc;
+                if(run_gang(&devices, command == validate_tcrt_command))
                 {
-                    if(command(fd))
+                    result = EXIT_SUCCESS;
+                }
+            }
+
+            globfree(&devices);
+        }
+        else if((daemon_connection = connect_daemon(args[0])) != -1)
+        {
+            // The daemon prints the statistics of the job
+            if(run_daemon_client(daemon_connection, command, print_statistics))
+            {
+                result = EXIT_SUCCESS;
+            }
+
+            print_statistics = false;
+            close(daemon_connection);
+        }
+        else
+        {
+            int fd = open_serial_port(args[0]);
+            if(fd != -1)
+            {
+                if(setup_serial_port(fd, baud_rate))
+                {
+                    if(skip_init_tapecart || init_tapecart(fd, print_sketch_version))
                     {
-                        result = EXIT_SUCCESS;
+                        if(command(fd))
+                        {
+                            result = EXIT_SUCCESS;
+                        }
                     }
                 }
+                else
+                {
+                    fprintf(stderr, "Failed to setup serial port. %s\n", strerror(errno));
+                }
+
+                close(fd);
             }
             else
             {
-                fprintf(stderr, "Failed to setup serial port. %s\n", strerror(errno));
+                fprintf(stderr, "Failed to open %s. %s\n", args[0], strerror(errno));
             }
-
-            close(fd);
         }
-        else
+
+        if(print_statistics)
         {
-            fprintf(stderr, "Failed to open %s. %s\n", argv[1], strerror(errno));
+            print_stats(links);
         }
     }
     else
     {
         fprintf(stderr, "Tapecart Flasher v0.2\n");
-        fprintf(stderr, "Usage: %s <tty device> <command>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options] <tty device> <command>\n", argv[0]);
+        fprintf(stderr, "       %s [options] <tty device,...|pattern> {flash|validate} <file.tcrt>\n", argv[0]);
         fprintf(stderr, "Commands:\n");
         fprintf(stderr, "    info\n");
         fprintf(stderr, "    reset\n");
@@ -280,9 +888,32 @@ int main(int argc, char** argv)
         fprintf(stderr, "    dump <out.tcrt>\n");
         fprintf(stderr, "    flash <file.tcrt>\n");
         fprintf(stderr, "    validate <file.tcrt>\n");
+        fprintf(stderr, "    archive <name>      dump into the --store archive\n");
+        fprintf(stderr, "    daemon              keep the port open and run the jobs of other invocations\n");
+        fprintf(stderr, "Archive commands, no device needed:\n");
+        fprintf(stderr, "    %s --store <dir> restore <name> <out.tcrt>\n", argv[0]);
+        fprintf(stderr, "    %s --store <dir> gc\n", argv[0]);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "    --diff              flash only erase blocks whose CRC32 differs from the file\n");
+        fprintf(stderr, "    --verify            check the CRC32 of every block after writing, rewrite on mismatch\n");
+        fprintf(stderr, "    --sparse            dump blank flash as file holes, only for this tool\n");
+        fprintf(stderr, "    --compress          dump into a compressed TCRT file, only for this tool\n");
+        fprintf(stderr, "    --reference <file>  dump copies blocks matching this TCRT file instead of reading them\n");
+        fprintf(stderr, "    --store <dir>       deduplicated archive of chunks and manifests\n");
+        fprintf(stderr, "    --socket <path>     daemon socket, default in $XDG_RUNTIME_DIR or %s<uid>\n",
+                DAEMON_SOCKET_DIR);
+        fprintf(stderr, "    --baud <rate|auto>  serial speed, auto switches both ends up from %u,\n"
+                        "                        sketches before API v%u stay at %u\n",
+                DEFAULT_BAUD_RATE, BAUD_RATE_API_VERSION, DEFAULT_BAUD_RATE);
+        fprintf(stderr, "    --retries <count>   attempts per block after a failure (dump, flash, validate), default %u\n",
+                block_retries);
+        fprintf(stderr, "    --resume            continue an interrupted dump, flash or validate\n");
+        fprintf(stderr, "    --stats             print timing, latency and error statistics when done\n");
         fprintf(stderr, "Example: \n");
         fprintf(stderr, "  %s /dev/ttyACM0 info\n", argv[0]);
+        fprintf(stderr, "  %s '/dev/ttyACM*' flash image.tcrt\n", argv[0]);
     }
 
     return result;
 }
+#endif
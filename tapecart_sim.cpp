@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stddef.h>
+#include <signal.h>
+#include <termios.h>
+#include "stats.cpp"
+#include "file_io.cpp"
+#include "commands.h"
+#include "tcrt_file.h"
+#include "crc32.cpp"
+#include "simulator.cpp"
+
+static Simulator simulator;
+
+static void stop_simulator(int signal_number)
+{
+    simulator.stop = true;
+}
+
+static bool parse_number(char *str, uint32_t *value)
+{
+    char *end;
+    unsigned long number = strtoul(str, &end, 0);
+
+    *value = (uint32_t)number;
+    return *str != '\0' && *end == '\0' && number <= 0xFFFFFFFF;
+}
+
+static bool parse_rate(char *str, double *value)
+{
+    char *end;
+    *value = strtod(str, &end);
+
+    return *str != '\0' && *end == '\0' && *value >= 0 && *value <= 1;
+}
+
+int main(int argc, char** argv)
+{
+    SimulatorConfig config;
+    init_simulator_config(&config);
+
+    char *image_filename = NULL;
+    char *link_path = NULL;
+    bool valid_options = true;
+
+    for(int i = 1; i < argc && valid_options; i++)
+    {
+        uint32_t value = 0;
+        char *option = argv[i];
+        char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if(strcmp(option, "--no-fast") == 0)
+        {
+            config.fast_commands = false;
+            continue;
+        }
+
+        if(!arg)
+        {
+            valid_options = false;
+            break;
+        }
+
+        i++;
+        if(strcmp(option, "--size") == 0)
+        {
+            valid_options = parse_number(arg, &config.flash_size);
+        }
+        else if(strcmp(option, "--page-size") == 0)
+        {
+            valid_options = parse_number(arg, &value) && value <= 0xFFFF;
+            config.page_size = value;
+        }
+        else if(strcmp(option, "--erase-pages") == 0)
+        {
+            valid_options = parse_number(arg, &value) && value <= 0xFFFF;
+            config.erase_pages = value;
+        }
+        else if(strcmp(option, "--api") == 0)
+        {
+            valid_options = parse_number(arg, &value) && value <= 0xFF;
+            config.api_version = value;
+        }
+        else if(strcmp(option, "--rx-window") == 0)
+        {
+            valid_options = parse_number(arg, &value) && value >= DEFAULT_HANDSHAKE_WINDOW && value <= 0x1000;
+            config.rx_window = value;
+        }
+        else if(strcmp(option, "--baud") == 0)
+        {
+            valid_options = parse_number(arg, &value) && value != 0;
+            config.baud_rate = value;
+            config.byte_delay_us = value ? 10 * 1000000 / value : 0;
+        }
+        else if(strcmp(option, "--max-baud") == 0)
+        {
+            valid_options = parse_number(arg, &config.max_baud_rate);
+        }
+        else if(strcmp(option, "--byte-delay") == 0)
+        {
+            valid_options = parse_number(arg, &config.byte_delay_us);
+        }
+        else if(strcmp(option, "--command-delay") == 0)
+        {
+            valid_options = parse_number(arg, &config.command_delay_us);
+        }
+        else if(strcmp(option, "--drop-rate") == 0)
+        {
+            valid_options = parse_rate(arg, &config.drop_rate);
+        }
+        else if(strcmp(option, "--bad-checksum-rate") == 0)
+        {
+            valid_options = parse_rate(arg, &config.bad_checksum_rate);
+        }
+        else if(strcmp(option, "--bad-write-rate") == 0)
+        {
+            valid_options = parse_rate(arg, &config.bad_write_rate);
+        }
+        else if(strcmp(option, "--debug-rate") == 0)
+        {
+            valid_options = parse_rate(arg, &config.debug_rate);
+        }
+        else if(strcmp(option, "--seed") == 0)
+        {
+            valid_options = parse_number(arg, &config.seed);
+        }
+        else if(strcmp(option, "--load") == 0)
+        {
+            image_filename = arg;
+        }
+        else if(strcmp(option, "--link") == 0)
+        {
+            link_path = arg;
+        }
+        else
+        {
+            valid_options = false;
+        }
+    }
+
+    if(!valid_options)
+    {
+        fprintf(stderr, "Tapecart Flasher simulator\n");
+        fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "    --size <bytes>              flash size (default 2097152)\n");
+        fprintf(stderr, "    --page-size <bytes>         flash page size (default 256)\n");
+        fprintf(stderr, "    --erase-pages <pages>       pages per erase block (default 16)\n");
+        fprintf(stderr, "    --api <version>             sketch API version (default %u)\n", SUPPORTED_API_VERSION);
+        fprintf(stderr, "    --no-fast                   answer NotImplemented to the fast commands\n");
+        fprintf(stderr, "    --rx-window <bytes>         payload per handshake from API v%u (default 256)\n",
+                RX_WINDOW_API_VERSION);
+        fprintf(stderr, "    --load <file.tcrt>          preload flash from a TCRT file\n");
+        fprintf(stderr, "    --link <path>               create a symlink to the PTY\n");
+        fprintf(stderr, "    --baud <rate>               model link speed, sets the byte delay\n");
+        fprintf(stderr, "    --max-baud <rate>           highest rate SetBaudRate accepts (default 2000000)\n");
+        fprintf(stderr, "    --byte-delay <us>           delay per byte sent or received\n");
+        fprintf(stderr, "    --command-delay <us>        delay per command\n");
+        fprintf(stderr, "    --drop-rate <0-1>           drop a byte from responses\n");
+        fprintf(stderr, "    --bad-checksum-rate <0-1>   corrupt the checksum of responses\n");
+        fprintf(stderr, "    --bad-write-rate <0-1>      clear a wrong bit when writing flash\n");
+        fprintf(stderr, "    --debug-rate <0-1>          interleave debug output\n");
+        fprintf(stderr, "    --seed <n>                  seed for fault injection\n");
+        fprintf(stderr, "Example: \n");
+        fprintf(stderr, "  %s --link /tmp/ttyTAPECART --baud 115200\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int result = EXIT_FAILURE;
+    if(init_simulator(&simulator, &config) &&
+       (!image_filename || load_simulator_image(&simulator, image_filename)))
+    {
+        char slave_path[64];
+        simulator.fd = open_simulator_pty(slave_path, sizeof(slave_path));
+
+        if(simulator.fd != -1)
+        {
+            if(!link_path || symlink(slave_path, link_path) == 0)
+            {
+                signal(SIGINT, stop_simulator);
+                signal(SIGTERM, stop_simulator);
+
+                printf("Simulating Tapecart on %s\n", link_path ? link_path : slave_path);
+                fflush(stdout);
+
+                run_simulator(&simulator);
+                result = EXIT_SUCCESS;
+
+                if(link_path)
+                {
+                    unlink(link_path);
+                }
+            }
+            else
+            {
+                fprintf(stderr, "Failed to create link %s. %s\n", link_path, strerror(errno));
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Failed to open PTY. %s\n", strerror(errno));
+        }
+    }
+
+    free_simulator(&simulator);
+    return result;
+}
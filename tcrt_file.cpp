@@ -1,21 +1,177 @@
 #include "tcrt_file.h"
+#include <sys/mman.h>
 
-// Adapted from crc32b - http://www.hackersdelight.org/hdcodetxt/crc.c.txt
-static uint32_t calculate_crc32(void *data, size_t size)
+#ifdef __linux__
+#include <linux/falloc.h>
+#define SPARSE_DUMP_SUPPORTED       // Needs hole punching and SEEK_DATA/SEEK_HOLE
+#endif
+
+#define RETRY_BACKOFF_MS 50         // Doubled for every further attempt
+#define MAX_REPORTED_BLOCKS 32
+
+static bool diff_flash = false;    // Only rewrite erase blocks that differ from the image
+static bool verify_flash = false;  // Check the CRC32 of every block right after writing it
+static bool sparse_dump = false;   // Leave blank flash as holes in the dump
+static bool compress_dump = false; // Write the dump content in packed blocks
+static uint32_t block_retries = 3;  // Attempts per block after the first one failed
+
+struct FlashSummary
+{
+    uint32_t blocks_total;
+    uint32_t blocks_skipped;
+    uint32_t pages_elided;
+    uint32_t bytes_elided;
+    uint32_t blocks_verified;
+};
+
+struct BlockList
+{
+    uint32_t count;
+    uint32_t addresses[MAX_REPORTED_BLOCKS];
+};
+
+struct RetryReport
+{
+    BlockList retried;
+    BlockList failed;
+    bool link_lost;     // Resync failed, no point in trying further blocks
+};
+
+// TCRT file mapped or, for sparse dumps, loaded into memory. Shared
+// read-only by the gang workers.
+struct TcrtImage
+{
+    uint8_t *data;
+    size_t size;
+    uint32_t crc32;     // Of the whole file, identifies the image in journals
+    bool mapped;
+    uint32_t *block_offsets;    // File offset of each packed block in compressed images
+};
+
+// Collects dumped flash content into blocks for compression
+struct BlockPacker
+{
+    uint8_t block[COMPRESSED_BLOCK_SIZE];
+    uint32_t fill;
+};
+
+static void print_progress(const char *action, uint32_t done, uint32_t total)
+{
+    if(link_progress)
+    {
+        __atomic_store_n(&link_progress->bytes_done, done, __ATOMIC_RELAXED);
+        return;
+    }
+
+    printf("\r%s %u bytes [%.1f%%] ", action, total, (100.0 / total) * done);
+    fflush(stdout);
+}
+
+static void add_block(BlockList *list, uint32_t address)
+{
+    if(list->count < MAX_REPORTED_BLOCKS)
+    {
+        list->addresses[list->count] = address;
+    }
+
+    list->count++;
+}
+
+static void print_block_list(const char *title, BlockList *list)
+{
+    printf("%s %u blocks:", title, list->count);
+    for(uint32_t i = 0; i < list->count && i < MAX_REPORTED_BLOCKS; i++)
+    {
+        printf(" %06x", list->addresses[i]);
+    }
+
+    printf(list->count > MAX_REPORTED_BLOCKS ? " ...\n" : "\n");
+}
+
+static void print_retry_report(RetryReport *report)
+{
+    if(link_progress)
+    {
+        link_progress->retried_blocks = report->retried.count;
+        link_progress->failed_blocks = report->failed.count;
+        return;
+    }
+
+    if(report->retried.count)
+    {
+        print_block_list("Retried", &report->retried);
+    }
+    if(report->failed.count)
+    {
+        print_block_list("Failed", &report->failed);
+    }
+}
+
+static uint32_t get_retry_backoff_ms(uint32_t attempt)
+{
+    return RETRY_BACKOFF_MS << (attempt < 5 ? attempt : 5);
+}
+
+static void backoff_and_resync(int fd, uint32_t attempt)
+{
+    stats.retries++;
+    usleep(get_retry_backoff_ms(attempt) * 1000);
+
+    if(!resync_link(fd))
+    {
+        // Still worth another attempt, the next one will resync again
+        print_link_message(stderr, "Link not responding\n");
+    }
+}
+
+// Called when an operation on the block at address failed. Backs off, resyncs
+// the link and returns true if the block should be tried again.
+static bool retry_block(int fd, uint32_t address, uint32_t attempt, RetryReport *report)
+{
+    if(attempt >= block_retries)
+    {
+        report->link_lost = !resync_link(fd);
+        return false;
+    }
+
+    if(attempt == 0)
+    {
+        add_block(&report->retried, address);
+    }
+
+    print_link_message(stderr, "Retrying block at address %06x in %u ms (%u of %u)\n",
+            address, get_retry_backoff_ms(attempt), attempt + 1, block_retries);
+    backoff_and_resync(fd, attempt);
+
+    return true;
+}
+
+// Same for the header and geometry exchanges before the blocks
+static bool retry_header(int fd, uint32_t attempt)
 {
-   uint8_t *bytes = (uint8_t *)data;
-   uint32_t crc = 0xFFFFFFFF;
+    if(attempt >= block_retries)
+    {
+        return false;
+    }
+
+    print_link_message(stderr, "Retrying in %u ms (%u of %u)\n",
+                       get_retry_backoff_ms(attempt), attempt + 1, block_retries);
+    backoff_and_resync(fd, attempt);
+
+    return true;
+}
 
-   while(size--)
-   {
-      crc ^= *bytes++;
-      for(uint8_t i=0; i<8; i++)
-      {
-         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
-      }
-   }
+static bool is_blank_flash(uint8_t *data, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+    {
+        if(data[i] != 0xFF)
+        {
+            return false;
+        }
+    }
 
-   return ~crc;
+    return true;
 }
 
 static bool validate_tcrt_signature(TcrtHeader *header)
@@ -31,7 +187,7 @@ static bool validate_tcrt_signature(TcrtHeader *header)
      return false;
 }
 
-static bool read_tcrt_header(int fd, TcrtHeader *header)
+static bool try_read_tcrt_header(int fd, TcrtHeader *header)
 {
     bool result = false;
 
@@ -52,285 +208,1178 @@ static bool read_tcrt_header(int fd, TcrtHeader *header)
             }
             else
             {
-                fprintf(stderr, "Failed to read device sizes from Tapecart\n");
+                print_link_message(stderr, "Failed to read device sizes from Tapecart\n");
             }
         }
         else
         {
-            fprintf(stderr, "Failed to read loader from Tapecart\n");
+            print_link_message(stderr, "Failed to read loader from Tapecart\n");
         }
     }
     else
     {
-        fprintf(stderr, "Failed to read loadinfo from Tapecart\n");
+        print_link_message(stderr, "Failed to read loadinfo from Tapecart\n");
     }
 
     return result;
 }
 
-static ssize_t flash_tcrt_header(int fd, TcrtHeader *header)
+static bool try_flash_tcrt_header(int fd, TcrtHeader *header)
 {
     bool result = false;
 
-    printf("Writing loadinfo\n");
+    if(!link_progress)
+    {
+        printf("Writing loadinfo\n");
+    }
+
     if(write_loadinfo(fd, &header->loadinfo))
     {
         if(header->misc_flags & MiscFlags_InitialLoaderValid)
         {
-            printf("Writing initial loader\n");
+            if(!link_progress)
+            {
+                printf("Writing initial loader\n");
+            }
+
             if(write_loader(fd, &header->initial_loader))
             {
                 result = true;
             }
             else
             {
-                fprintf(stderr, "Failed to write loader to Tapecart\n");
+                print_link_message(stderr, "Failed to write loader to Tapecart\n");
             }
         }
         else
         {
             result = true;
-            printf("No initial loader in file\n");
+            if(!link_progress)
+            {
+                printf("No initial loader in file\n");
+            }
         }
     }
     else
     {
-        fprintf(stderr, "Failed to write loadinfo to Tapecart\n");
+        print_link_message(stderr, "Failed to write loadinfo to Tapecart\n");
     }
 
     return result;
 }
 
-static bool dump_tcrt_to_file(int fd, int file)
+static bool read_tcrt_header(int fd, TcrtHeader *header)
 {
-    bool result = false;
-
-    TcrtHeader header = {};
-    if(read_tcrt_header(fd, &header))
+    for(uint32_t attempt = 0; ; attempt++)
     {
-        if(write_file(file, &header, sizeof(header)))
+        if(try_read_tcrt_header(fd, header))
         {
-            result = true;
-            uint8_t buffer[0x100];
-            uint32_t buffer_size = sizeof(buffer);
+            return true;
+        }
 
-            for(uint32_t i = 0; i < header.flash_content_length; i += buffer_size)
-            {
-                if(read_flash(fd, i, buffer_size, buffer))
-                {
-                    if(write_file(file, buffer, buffer_size))
-                    {
-                        double percent = (100.0 / header.flash_content_length) * (i + buffer_size);
-                        printf("\rReading %u bytes from flash [%.1f%%] ", header.flash_content_length, percent);
-                        fflush(stdout);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Failed to write data to file. %s\n", strerror(errno));
-                        result = false;
-                        break;
-                    }
-                }
-                else
-                {
-                    fprintf(stderr, "Failed to read from flash address %06x\n", i);
-                    result = false;
-                    break;
-                }
-            }
+        if(!retry_header(fd, attempt))
+        {
+            return false;
+        }
+    }
+}
 
-            printf("\n");
+static bool flash_tcrt_header(int fd, TcrtHeader *header)
+{
+    for(uint32_t attempt = 0; ; attempt++)
+    {
+        if(try_flash_tcrt_header(fd, header))
+        {
+            return true;
         }
-        else
+
+        if(!retry_header(fd, attempt))
         {
-            fprintf(stderr, "Failed to write header to file. %s\n", strerror(errno));
+            return false;
         }
     }
+}
 
-    return result;
+static bool read_device_sizes(int fd, DeviceSizes *sizes)
+{
+    for(uint32_t attempt = 0; ; attempt++)
+    {
+        if(get_device_sizes(fd, sizes))
+        {
+            return true;
+        }
+
+        if(!retry_header(fd, attempt))
+        {
+            return false;
+        }
+    }
 }
 
-static bool flash_tcrt_file(int fd, int file)
+// Read part of a file written with MiscFlags_SparseBlankFill. Holes are
+// filled with 0xFF without reading them.
+static bool read_sparse_file(int file, uint8_t *buffer, size_t size, off_t offset)
 {
-    bool result = false;
+#ifdef SPARSE_DUMP_SUPPORTED
+    off_t end = offset + size;
 
-    TcrtHeader header = {};
-    if(read_file(file, &header, sizeof(header)))
+    while(offset < end)
     {
-        if(validate_tcrt_signature(&header))
+        off_t data = lseek(file, offset, SEEK_DATA);
+        if(data == -1)
         {
-            if(flash_tcrt_header(fd, &header))
+            if(errno != ENXIO)
             {
-                DeviceSizes device_sizes;
-                if(get_device_sizes(fd, &device_sizes))
-                {
-                    result = true;
-                    uint32_t flash_block_size = device_sizes.page_size * device_sizes.erase_pages;
+                return false;
+            }
+
+            data = end;     // Only a hole left up to the end of the file
+        }
 
-                    WriteFlash write_flash_data = {};
-                    write_flash_data.length = sizeof(write_flash_data.data);
+        data = data < end ? data : end;
+        memset(buffer, 0xFF, data - offset);
+        buffer += data - offset;
+        offset = data;
 
-                    for(uint32_t i = 0; i < header.flash_content_length; i += write_flash_data.length)
-                    {
-                        if(read_file(file, &write_flash_data.data, write_flash_data.length))
-                        {
-                            if(flash_block_size && (i % flash_block_size) == 0)
-                            {
-                                if(!erase_flash_block(fd, i))
-                                {
-                                    fprintf(stderr, "Failed to erase flash block at address %06x", i);
-                                    result = false;
-                                    break;
-                                }
-                            }
-
-                            write_flash_data.start_address = i;
-                            if(write_flash(fd, &write_flash_data))
-                            {
-                                double percent = (100.0 / header.flash_content_length) * (i + write_flash_data.length);
-                                printf("\rWriting %u bytes to flash [%.1f%%] ", header.flash_content_length, percent);
-                                fflush(stdout);
-                            }
-                            else
-                            {
-                                fprintf(stderr, "Failed to write to flash address %06x\n", i);
-                                result = false;
-                                break;
-                            }
-                        }
-                        else
-                        {
-                            fprintf(stderr, "Failed to read data from file. %s\n", strerror(errno));
-                            result = false;
-                            break;
-                        }
-                    }
+        if(offset < end)
+        {
+            off_t hole = lseek(file, offset, SEEK_HOLE);
+            hole = hole != -1 && hole < end ? hole : end;
 
-                    printf("\n");
-                }
-                else
-                {
-                    fprintf(stderr, "Failed to read device sizes from Tapecart\n");
-                }
+            if(!read_file_at(file, buffer, hole - offset, offset))
+            {
+                return false;
             }
+
+            buffer += hole - offset;
+            offset = hole;
         }
-        else
+    }
+
+    return true;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+// Store a run of blank flash in a sparse dump. Only whole file system blocks
+// can be holes, the unaligned ends are written out as 0xFF.
+static bool write_blank_run(int file, off_t start, off_t end)
+{
+    struct stat file_stat;
+    off_t block_size = fstat(file, &file_stat) == 0 && file_stat.st_blksize > 0 ? file_stat.st_blksize : 4096;
+    off_t hole_start = (start + block_size - 1) / block_size * block_size;
+    off_t hole_end = end / block_size * block_size;
+
+    bool punched = false;
+#ifdef SPARSE_DUMP_SUPPORTED
+    punched = hole_start < hole_end &&
+              fallocate(file, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, hole_start, hole_end - hole_start) == 0;
+#endif
+
+    if(!punched)
+    {
+        // Nothing to punch, or the file system cannot, so write it all
+        hole_start = hole_end = end;
+    }
+
+    uint8_t blank[4096];
+    memset(blank, 0xFF, sizeof(blank));
+
+    for(off_t offset = start; offset < end; )
+    {
+        if(offset == hole_start)
+        {
+            offset = hole_end;
+            continue;
+        }
+
+        off_t limit = offset < hole_start ? hole_start : end;
+        size_t size = limit - offset < (off_t)sizeof(blank) ? limit - offset : sizeof(blank);
+
+        if(!write_file_at(file, blank, size, offset))
         {
-            fprintf(stderr, "Invalid TCRT file\n");
+            return false;
         }
+
+        offset += size;
     }
-    else
+
+    return true;
+}
+
+// Append the CRC32 of the expanded content of a finished sparse dump, buffer
+// is scratch space of buffer_size bytes
+static bool write_sparse_trailer(int file, uint32_t flash_content_length, uint8_t *buffer, uint32_t buffer_size)
+{
+    SparseTrailer trailer;
+    memcpy(trailer.signature, SPARSE_TRAILER_SIGNATURE, sizeof(trailer.signature));
+
+    uint32_t crc = 0xFFFFFFFF;
+    for(uint32_t i = 0; i < flash_content_length; i += buffer_size)
+    {
+        uint32_t size = flash_content_length - i < buffer_size ? flash_content_length - i : buffer_size;
+        if(!read_sparse_file(file, buffer, size, sizeof(TcrtHeader) + i))
+        {
+            return false;
+        }
+
+        crc = crc32_update(crc, buffer, size);
+    }
+
+    trailer.content_crc32 = ~crc;
+    return write_file_at(file, &trailer, sizeof(trailer), sizeof(TcrtHeader) + flash_content_length);
+}
+
+// A block dumped by an interrupted run is kept if the file still holds what
+// the flash holds
+static bool is_dumped_block_valid(int fd, int file, uint32_t address, uint8_t *buffer, uint32_t length)
+{
+    uint32_t flash_crc32;
+    off_t offset = sizeof(TcrtHeader) + address;
+
+    return (sparse_dump ? read_sparse_file(file, buffer, length, offset) :
+                          read_file_at(file, buffer, length, offset)) &&
+           crc32_flash(fd, address, length, &flash_crc32) &&
+           flash_crc32 == calculate_crc32(buffer, length);
+}
+
+// Write out a pending run of blank flash, if any
+static bool flush_blank_run(int file, off_t *blank_start, off_t end)
+{
+    bool result = *blank_start == -1 || write_blank_run(file, *blank_start, end);
+    *blank_start = -1;
+
+    if(!result)
     {
-        fprintf(stderr, "Failed to load TCRT file. %s\n", strerror(errno));
+        print_link_message(stderr, "Failed to write data to file. %s\n", strerror(errno));
     }
 
     return result;
 }
 
-static bool validate_tcrt_header(int fd, int file, TcrtHeader *fileHeader)
+static bool write_packed_block(int file, uint8_t *data, uint32_t size)
 {
-    bool result = false;
+    uint8_t packed[PACKED_BLOCK_MAX_SIZE];
+    return write_file(file, packed, pack_block(data, size, packed));
+}
 
-    if(read_file(file, fileHeader, sizeof(*fileHeader)))
+// Add dumped flash content to a compressed dump
+static bool write_packed_content(int file, BlockPacker *packer, uint8_t *data, uint32_t size)
+{
+    while(size > 0)
     {
-        if(validate_tcrt_signature(fileHeader))
+        uint32_t copy_size = COMPRESSED_BLOCK_SIZE - packer->fill < size ? COMPRESSED_BLOCK_SIZE - packer->fill : size;
+        memcpy(packer->block + packer->fill, data, copy_size);
+        packer->fill += copy_size;
+        data += copy_size;
+        size -= copy_size;
+
+        if(packer->fill == COMPRESSED_BLOCK_SIZE)
         {
-            TcrtHeader header = {};
-            if(read_tcrt_header(fd, &header))
+            packer->fill = 0;
+            if(!write_packed_block(file, packer->block, COMPRESSED_BLOCK_SIZE))
             {
-                if(memcmp(&fileHeader->loadinfo, &header.loadinfo, sizeof(header.loadinfo)) == 0)
-                {
-                    if((fileHeader->misc_flags & MiscFlags_InitialLoaderValid) == 0 ||
-                       memcmp(&fileHeader->initial_loader, &header.initial_loader, sizeof(header.initial_loader)) == 0)
-                    {
-                        result = true;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Initial loader does not match\n");
-                    }
-                }
-                else
-                {
-                    fprintf(stderr, "Loadinfo does not match\n");
-                }
+                return false;
             }
         }
-        else
+    }
+
+    return true;
+}
+
+// Write the last, shorter block of a compressed dump
+static bool flush_block_packer(int file, BlockPacker *packer)
+{
+    bool result = packer->fill == 0 || write_packed_block(file, packer->block, packer->fill);
+    packer->fill = 0;
+
+    return result;
+}
+
+// Find the packed blocks of a compressed image and check that they unpack
+static bool index_packed_blocks(TcrtImage *image)
+{
+    uint32_t length = ((TcrtHeader *)image->data)->flash_content_length;
+    uint32_t block_count = (length + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+    uint8_t *end = image->data + image->size;
+    uint8_t *packed = image->data + sizeof(TcrtHeader);
+    uint8_t block[COMPRESSED_BLOCK_SIZE];
+
+    image->block_offsets = (uint32_t *)malloc((block_count + 1) * sizeof(uint32_t));
+
+    for(uint32_t i = 0; i < block_count; i++)
+    {
+        uint32_t block_length = length - i * COMPRESSED_BLOCK_SIZE < COMPRESSED_BLOCK_SIZE ?
+                                length - i * COMPRESSED_BLOCK_SIZE : COMPRESSED_BLOCK_SIZE;
+        size_t packed_size = get_packed_block_size(packed, end);
+
+        if(!packed_size || !unpack_block(packed, packed_size, block, block_length))
         {
-            fprintf(stderr, "Invalid TCRT file\n");
+            return false;
         }
+
+        image->block_offsets[i] = packed - image->data;
+        packed += packed_size;
     }
-    else
+
+    image->block_offsets[block_count] = packed - image->data;
+    return packed == end;
+}
+
+// Flash content of the image at address. Compressed images are unpacked into
+// scratch, which has to hold length bytes, plain images are used in place.
+static uint8_t *get_image_content(TcrtImage *image, uint32_t address, uint32_t length, uint8_t *scratch)
+{
+    if(!image->block_offsets)
     {
-        fprintf(stderr, "Failed to load TCRT file. %s\n", strerror(errno));
+        return image->data + sizeof(TcrtHeader) + address;
     }
 
-    return result;
+    uint32_t content_length = ((TcrtHeader *)image->data)->flash_content_length;
+    uint8_t block[COMPRESSED_BLOCK_SIZE];
+
+    for(uint32_t done = 0; done < length; )
+    {
+        uint32_t index = (address + done) / COMPRESSED_BLOCK_SIZE;
+        uint32_t block_start = index * COMPRESSED_BLOCK_SIZE;
+        uint32_t block_length = content_length - block_start < COMPRESSED_BLOCK_SIZE ?
+                                content_length - block_start : COMPRESSED_BLOCK_SIZE;
+        uint32_t skip = address + done - block_start;
+        uint32_t size = block_length - skip < length - done ? block_length - skip : length - done;
+
+        // Whole blocks are unpacked straight into scratch
+        uint8_t *target = skip == 0 && size == block_length ? scratch + done : block;
+        uint8_t *packed = image->data + image->block_offsets[index];
+
+        // Checked when the image was loaded
+        unpack_block(packed, image->block_offsets[index + 1] - image->block_offsets[index], target, block_length);
+        if(target == block)
+        {
+            memcpy(scratch + done, block + skip, size);
+        }
+
+        done += size;
+    }
+
+    return scratch;
+}
+
+// CRC32 of a block as computed by the Tapecart, used to find out what the
+// block holds without reading it over the link
+static bool get_flash_block_crc32(int fd, uint32_t address, uint32_t length, uint32_t *crc,
+                                  bool *crc_supported)
+{
+    if(*crc_supported && !crc32_flash(fd, address, length, crc))
+    {
+        // Any other failure is handled when the block is read
+        *crc_supported = last_command_result != CommandResult_NotImplemented;
+        return false;
+    }
+
+    return *crc_supported;
+}
+
+// Print how the dump differs from the reference image
+static void print_reference_report(TcrtHeader *header, TcrtImage *reference, BlockList *differing,
+                                   uint32_t reference_blocks)
+{
+    TcrtHeader *reference_header = (TcrtHeader *)reference->data;
+
+    if(memcmp(&header->loadinfo, &reference_header->loadinfo, sizeof(header->loadinfo)) != 0)
+    {
+        printf("Loadinfo differs from reference\n");
+    }
+
+    // Without the flag the loader bytes of a file mean nothing
+    if((header->misc_flags & MiscFlags_InitialLoaderValid) &&
+       (reference_header->misc_flags & MiscFlags_InitialLoaderValid) &&
+       memcmp(&header->initial_loader, &reference_header->initial_loader, sizeof(header->initial_loader)) != 0)
+    {
+        printf("Initial loader differs from reference\n");
+    }
+
+    printf("Copied %u blocks from reference\n", reference_blocks);
+    if(differing->count)
+    {
+        print_block_list("Differs from reference in", differing);
+    }
+    else
+    {
+        printf("Flash content matches reference\n");
+    }
 }
 
-static bool validate_tcrt_file(int fd, int file)
+// Blocks that match the reference image, if any, are copied from it instead
+// of being read over the link
+static bool dump_tcrt_to_file(int fd, int file, const char *filename, TcrtImage *reference)
 {
     bool result = false;
 
     TcrtHeader header = {};
-    if(validate_tcrt_header(fd, file, &header))
+    DeviceSizes device_sizes;
+    if(read_tcrt_header(fd, &header) && read_device_sizes(fd, &device_sizes))
     {
-        DeviceSizes device_sizes;
-        if(get_device_sizes(fd, &device_sizes))
+        if(sparse_dump)
+        {
+            header.misc_flags = (MiscFlags)(header.misc_flags | MiscFlags_SparseBlankFill);
+        }
+        if(compress_dump)
+        {
+            header.misc_flags = (MiscFlags)(header.misc_flags | MiscFlags_Compressed);
+        }
+
+        if(write_file(file, &header, sizeof(header)))
         {
             result = true;
             uint32_t flash_block_size = device_sizes.page_size * device_sizes.erase_pages;
-            uint32_t buffer_size = flash_block_size ? flash_block_size : 4*1024;
-            uint8_t *buffer = (uint8_t *)malloc(buffer_size);
+            uint32_t block_size = flash_block_size ? flash_block_size : FAST_FLASH_MAX_LENGTH;
+            uint8_t *buffer = (uint8_t *)malloc(block_size);
+            RetryReport report = {};
+            off_t blank_start = -1;     // File offset where the current run of blank flash started
+            uint32_t blank_blocks = 0;
+            uint32_t reference_blocks = 0;
+            BlockList differing = {};
+            bool crc_supported = true;
 
-            for(uint32_t i = 0; i < header.flash_content_length; i += buffer_size)
-            {
-                if(read_file(file, buffer, buffer_size))
-                {
-                    uint32_t file_crc32 = calculate_crc32(buffer, buffer_size);
+            uint32_t reference_length = reference ? ((TcrtHeader *)reference->data)->flash_content_length : 0;
+            uint8_t *reference_scratch = reference && reference->block_offsets ? (uint8_t *)malloc(block_size) : NULL;
+            BlockPacker packer = {};
 
-                    uint32_t flash_crc32;
-                    if(crc32_flash(fd, i, buffer_size, &flash_crc32))
+            memset(buffer, 0xFF, block_size);
+            uint32_t blank_crc32 = calculate_crc32(buffer, block_size);
+
+            // A compressed dump is written in one go, it cannot be resumed
+            Journal journal = {};
+            journal.file = -1;
+            if(!compress_dump)
+            {
+                open_journal(&journal, fd, filename, JournalOperation_Dump, calculate_crc32(&header, sizeof(header)),
+                             header.flash_content_length, block_size);
+            }
+
+            for(uint32_t i = 0; i < header.flash_content_length && !report.link_lost; i += block_size)
+            {
+                uint32_t buffer_size = header.flash_content_length - i < block_size ?
+                                       header.flash_content_length - i : block_size;
+                off_t offset = sizeof(header) + i;
+
+                if(interrupted)
+                {
+                    print_link_message(stderr, "\nInterrupted\n");
+                    result = false;
+                    break;
+                }
+
+                bool in_reference = reference && i + buffer_size <= reference_length;
+                uint8_t *reference_block = in_reference ?
+                                           get_image_content(reference, i, buffer_size, reference_scratch) : NULL;
+
+                if(is_block_done(&journal, i) && is_dumped_block_valid(fd, file, i, buffer, buffer_size))
+                {
+                    if(reference && (!in_reference || memcmp(buffer, reference_block, buffer_size) != 0))
                     {
-                        if(file_crc32 == flash_crc32)
-                        {
-                            double percent = (100.0 / header.flash_content_length) * (i + buffer_size);
-                            printf("\rValidating %u bytes [%.1f%%] ", header.flash_content_length, percent);
-                            fflush(stdout);
-                        }
-                        else
+                        add_block(&differing, i);
+                    }
+
+                    if(!flush_blank_run(file, &blank_start, offset))
+                    {
+                        result = false;
+                        break;
+                    }
+
+                    if(lseek(file, buffer_size, SEEK_CUR) == -1)
+                    {
+                        print_link_message(stderr, "Failed to seek in file. %s\n", strerror(errno));
+                        result = false;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                if(buffer_size != block_size)
+                {
+                    memset(buffer, 0xFF, buffer_size);
+                    blank_crc32 = calculate_crc32(buffer, buffer_size);
+                }
+
+                bool block_valid = true;
+                uint32_t flash_crc32;
+                bool crc_valid = get_flash_block_crc32(fd, i, buffer_size, &flash_crc32, &crc_supported);
+
+                if(crc_valid && in_reference && flash_crc32 == calculate_crc32(reference_block, buffer_size))
+                {
+                    memcpy(buffer, reference_block, buffer_size);
+                    reference_blocks++;
+                }
+                else if(crc_valid && flash_crc32 == blank_crc32)
+                {
+                    memset(buffer, 0xFF, buffer_size);
+                    blank_blocks++;
+                }
+                else
+                {
+                    for(uint32_t attempt = 0; !read_flash_data(fd, i, buffer_size, buffer); attempt++)
+                    {
+                        print_link_message(stderr, "Failed to read from flash address %06x\n", i);
+                        if(!retry_block(fd, i, attempt, &report))
                         {
-                            fprintf(stderr, "CRC32 check failed for flash block at address %06x\n", i);
+                            add_block(&report.failed, i);
+
+                            // Keep the file layout intact, the dump is reported as failed
+                            memset(buffer, 0xFF, buffer_size);
+                            block_valid = false;
                             result = false;
                             break;
                         }
                     }
-                    else
+                }
+
+                if(reference && (!in_reference || memcmp(buffer, reference_block, buffer_size) != 0))
+                {
+                    add_block(&differing, i);
+                }
+
+                bool written;
+                if(compress_dump)
+                {
+                    written = write_packed_content(file, &packer, buffer, buffer_size);
+                }
+                else if(sparse_dump && is_blank_flash(buffer, buffer_size))
+                {
+                    // Leave it to flush_blank_run() once the run ends
+                    if(blank_start == -1)
+                    {
+                        blank_start = offset;
+                    }
+
+                    written = lseek(file, buffer_size, SEEK_CUR) != -1;
+                }
+                else
+                {
+                    written = flush_blank_run(file, &blank_start, offset) && write_file(file, buffer, buffer_size);
+                }
+
+                if(written)
+                {
+                    if(block_valid)
                     {
-                        fprintf(stderr, "Failed to get CRC32 for flash block at address %06x\n", i);
-                        result = false;
-                        break;
+                        mark_block_done(&journal, i);
                     }
+
+                    print_progress("Reading from flash", i + buffer_size, header.flash_content_length);
                 }
                 else
                 {
-                    fprintf(stderr, "Failed to read data from file. %s\n", strerror(errno));
+                    print_link_message(stderr, "Failed to write data to file. %s\n", strerror(errno));
                     result = false;
                     break;
                 }
             }
 
+            // A trailing hole does not extend the file by itself, the trailer
+            // is only written once all blocks are there
+            off_t file_size = sizeof(header) + header.flash_content_length;
+            if(sparse_dump && (!flush_blank_run(file, &blank_start, lseek(file, 0, SEEK_CUR)) ||
+                               ftruncate(file, file_size) != 0 ||
+                               (result && !write_sparse_trailer(file, header.flash_content_length, buffer, block_size))))
+            {
+                print_link_message(stderr, "Failed to write data to file. %s\n", strerror(errno));
+                result = false;
+            }
+
+            if(compress_dump && !flush_block_packer(file, &packer))
+            {
+                print_link_message(stderr, "Failed to write data to file. %s\n", strerror(errno));
+                result = false;
+            }
+
+            free(reference_scratch);
             free(buffer);
 
-            if(result)
+            printf("\n");
+            print_retry_report(&report);
+            close_journal(&journal, result);
+
+            if(result && blank_blocks)
+            {
+                printf("Skipped reading %u blank flash blocks\n", blank_blocks);
+            }
+            if(result && reference)
+            {
+                print_reference_report(&header, reference, &differing, reference_blocks);
+            }
+        }
+        else
+        {
+            print_link_message(stderr, "Failed to write header to file. %s\n", strerror(errno));
+        }
+    }
+
+    return result;
+}
+
+// Write one block. Blank pages skipped on an erased block are counted in
+// *pages_elided and *bytes_elided, which start at zero.
+static bool flash_tcrt_block(int fd, uint32_t address, uint8_t *buffer, uint32_t length, bool erased,
+                             uint32_t flash_content_length, uint32_t *pages_elided, uint32_t *bytes_elided)
+{
+    const uint32_t page_size = sizeof(((WriteFlash *)0)->data);
+    uint32_t i = 0;
+
+    while(i < length)
+    {
+        uint32_t data_size = length - i < page_size ? length - i : page_size;
+
+        // An erased block is already 0xFF, no need to transfer blank pages
+        if(erased && is_blank_flash(buffer + i, data_size))
+        {
+            (*pages_elided)++;
+            *bytes_elided += data_size;
+            i += data_size;
+            continue;
+        }
+
+        // Send the following non-blank pages in one go
+        uint32_t run_size = data_size;
+        while(i + run_size < length)
+        {
+            uint32_t next_size = length - i - run_size < page_size ? length - i - run_size : page_size;
+            if(erased && is_blank_flash(buffer + i + run_size, next_size))
+            {
+                break;
+            }
+
+            run_size += next_size;
+        }
+
+        if(write_flash_data(fd, address + i, run_size, buffer + i))
+        {
+            i += run_size;
+
+            print_progress("Writing to flash", address + i, flash_content_length);
+        }
+        else
+        {
+            print_link_message(stderr, "Failed to write to flash address %06x\n", address + i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Compare the device CRC32 of a block just written with the image. A failed
+// check is handled like a failed write, the block is erased and rewritten.
+static bool verify_flash_block(int fd, uint32_t address, uint8_t *buffer, uint32_t length, FlashSummary *summary)
+{
+    uint32_t flash_crc32;
+
+    if(!crc32_flash(fd, address, length, &flash_crc32))
+    {
+        print_link_message(stderr, "Failed to get CRC32 for flash block at address %06x\n", address);
+        return false;
+    }
+
+    if(flash_crc32 != calculate_crc32(buffer, length))
+    {
+        print_link_message(stderr, "CRC32 check failed for flash block at address %06x\n", address);
+        return false;
+    }
+
+    summary->blocks_verified++;
+    return true;
+}
+
+// Flash a region of consecutive blocks. An aligned 64K region where every
+// block needs rewriting is erased with a single EraseFlash64K command.
+// Blocks that fail are retried and end up in the report. Returns false
+// only when the link is lost or the job was interrupted.
+static bool flash_tcrt_region(int fd, uint32_t address, uint8_t *buffer, uint32_t length,
+                              uint32_t block_size, bool *dirty_blocks, bool erase,
+                              uint32_t flash_content_length, FlashSummary *summary,
+                              RetryReport *report, Journal *journal)
+{
+    uint32_t block_count = 0, dirty_count = 0;
+
+    for(uint32_t i = 0; i < length; i += block_size, block_count++)
+    {
+        uint32_t block_length = length - i < block_size ? length - i : block_size;
+        dirty_blocks[block_count] = true;
+        summary->blocks_total++;
+
+        if(diff_flash || is_block_done(journal, address + i))
+        {
+            // Leave blocks that already match the image untouched. If the
+            // CRC cannot be read the block is simply rewritten.
+            uint32_t flash_crc32;
+            bool crc_valid = true;
+
+            for(uint32_t attempt = 0; !crc32_flash(fd, address + i, block_length, &flash_crc32); attempt++)
+            {
+                print_link_message(stderr, "Failed to get CRC32 for flash block at address %06x\n", address + i);
+                if(!retry_block(fd, address + i, attempt, report))
+                {
+                    crc_valid = false;
+                    break;
+                }
+            }
+
+            if(report->link_lost)
+            {
+                return false;
+            }
+
+            if(crc_valid && flash_crc32 == calculate_crc32(buffer + i, block_length))
+            {
+                dirty_blocks[block_count] = false;
+                summary->blocks_skipped++;
+            }
+        }
+
+        if(dirty_blocks[block_count])
+        {
+            dirty_count++;
+        }
+    }
+
+    bool erase_64k = erase && length == 0x10000 && (address % 0x10000) == 0 && dirty_count == block_count;
+    if(erase_64k)
+    {
+        for(uint32_t attempt = 0; !erase_flash_64k(fd, address); attempt++)
+        {
+            print_link_message(stderr, "Failed to erase 64K flash region at address %06x\n", address);
+            if(!retry_block(fd, address, attempt, report))
+            {
+                // Fall back to erasing block by block
+                erase_64k = false;
+                break;
+            }
+        }
+
+        if(report->link_lost)
+        {
+            return false;
+        }
+    }
+
+    for(uint32_t i = 0, block = 0; i < length; i += block_size, block++)
+    {
+        uint32_t block_length = length - i < block_size ? length - i : block_size;
+
+        if(interrupted)
+        {
+            return false;
+        }
+
+        if(dirty_blocks[block])
+        {
+            for(uint32_t attempt = 0; ; attempt++)
+            {
+                // A partly written block has to be erased again before a retry
+                bool erase_block = erase && (!erase_64k || attempt > 0);
+                uint32_t pages_elided = 0, bytes_elided = 0;
+
+                if(erase_block && !erase_flash_block(fd, address + i))
+                {
+                    print_link_message(stderr, "Failed to erase flash block at address %06x\n", address + i);
+                }
+                else if(flash_tcrt_block(fd, address + i, buffer + i, block_length, erase,
+                                         flash_content_length, &pages_elided, &bytes_elided) &&
+                        (!verify_flash || verify_flash_block(fd, address + i, buffer + i, block_length, summary)))
+                {
+                    // Count elided pages of the attempt that succeeded only
+                    summary->pages_elided += pages_elided;
+                    summary->bytes_elided += bytes_elided;
+                    mark_block_done(journal, address + i);
+                    break;
+                }
+
+                if(!retry_block(fd, address + i, attempt, report))
+                {
+                    add_block(&report->failed, address + i);
+                    break;
+                }
+            }
+
+            if(report->link_lost)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            mark_block_done(journal, address + i);
+
+            print_progress("Writing to flash", address + i + block_length, flash_content_length);
+        }
+    }
+
+    return true;
+}
+
+// Holes in a sparse dump have to read as 0xFF, so such files are read into
+// memory. Anything else is mapped and sent to the Tapecart from the mapping.
+static bool map_tcrt_image(int file, TcrtImage *image)
+{
+    TcrtHeader header;
+    if(!read_file_at(file, &header, sizeof(header), 0))
+    {
+        return false;
+    }
+
+    if((header.misc_flags & MiscFlags_SparseBlankFill) && (header.misc_flags & MiscFlags_Compressed))
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    if(header.misc_flags & MiscFlags_SparseBlankFill)
+    {
+        SparseTrailer trailer;
+        size_t content_end = sizeof(header) + header.flash_content_length;
+
+        if(image->size < content_end + sizeof(trailer) ||
+           !read_file_at(file, &trailer, sizeof(trailer), content_end) ||
+           memcmp(trailer.signature, SPARSE_TRAILER_SIGNATURE, sizeof(trailer.signature)) != 0)
+        {
+            print_link_message(stderr, "Sparse TCRT file is truncated or from an interrupted dump\n");
+            errno = EINVAL;
+            return false;
+        }
+
+        // Loaded, the image is the same as a plain dump
+        image->mapped = false;
+        image->size = content_end;
+        image->data = (uint8_t *)malloc(image->size);
+        memcpy(image->data, &header, sizeof(header));
+        ((TcrtHeader *)image->data)->misc_flags = (MiscFlags)(header.misc_flags & ~MiscFlags_SparseBlankFill);
+
+        if(read_sparse_file(file, image->data + sizeof(header), header.flash_content_length, sizeof(header)))
+        {
+            if(calculate_crc32(image->data + sizeof(header), header.flash_content_length) == trailer.content_crc32)
+            {
+                return true;
+            }
+
+            // Holes filled with zeros, or zeros turned into holes, by a copy
+            print_link_message(stderr, "Sparse TCRT file content does not match its CRC32, "
+                                       "it was probably copied without keeping its holes\n");
+            errno = EINVAL;
+        }
+
+        free(image->data);
+        image->data = NULL;
+        return false;
+    }
+
+    void *data = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, file, 0);
+    if(data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    madvise(data, image->size, MADV_SEQUENTIAL);
+    image->mapped = true;
+    image->data = (uint8_t *)data;
+
+    // The whole file is read once here, for the journal CRC
+    uint64_t start_us = get_time_us();
+    image->crc32 = calculate_crc32(image->data, image->size);
+    add_phase_time(StatsPhase_FileIo, get_time_us() - start_us);
+    stats.file_bytes += image->size;
+
+    return true;
+}
+
+static void free_tcrt_image(TcrtImage *image)
+{
+    if(image->mapped)
+    {
+        munmap(image->data, image->size);
+    }
+    else
+    {
+        free(image->data);
+    }
+
+    free(image->block_offsets);
+    image->block_offsets = NULL;
+    image->data = NULL;
+}
+
+static bool load_tcrt_image(int file, TcrtImage *image)
+{
+    bool result = false;
+
+    struct stat file_stat;
+    if(fstat(file, &file_stat) == 0)
+    {
+        image->size = file_stat.st_size;
+        image->data = NULL;
+        image->block_offsets = NULL;
+
+        if(image->size < sizeof(TcrtHeader))
+        {
+            print_link_message(stderr, "Invalid TCRT file\n");
+        }
+        else if(map_tcrt_image(file, image))
+        {
+            TcrtHeader *header = (TcrtHeader *)image->data;
+
+            bool compressed = header->misc_flags & MiscFlags_Compressed;
+
+            if(validate_tcrt_signature(header))
+            {
+                if(compressed ? index_packed_blocks(image) :
+                                header->flash_content_length <= image->size - sizeof(TcrtHeader))
+                {
+                    if(!image->mapped)
+                    {
+                        image->crc32 = calculate_crc32(image->data, image->size);
+                    }
+
+                    result = true;
+                }
+                else
+                {
+                    print_link_message(stderr, compressed ? "Compressed TCRT file is damaged\n"
+                                                          : "TCRT file is truncated\n");
+                }
+            }
+            else
+            {
+                print_link_message(stderr, "Invalid TCRT file\n");
+            }
+
+            if(!result)
+            {
+                free_tcrt_image(image);
+            }
+        }
+        else
+        {
+            print_link_message(stderr, "Failed to load TCRT file. %s\n", strerror(errno));
+        }
+    }
+    else
+    {
+        print_link_message(stderr, "Failed to load TCRT file. %s\n", strerror(errno));
+    }
+
+    return result;
+}
+
+static bool flash_tcrt_file(int fd, TcrtImage *image, const char *journal_name)
+{
+    bool result = false;
+
+    TcrtHeader *header = (TcrtHeader *)image->data;
+
+    if(flash_tcrt_header(fd, header))
+    {
+        DeviceSizes device_sizes;
+        if(read_device_sizes(fd, &device_sizes))
+        {
+            result = true;
+            uint32_t flash_block_size = device_sizes.page_size * device_sizes.erase_pages;
+            uint32_t block_size = flash_block_size ? flash_block_size : 4*1024;
+
+            // Work in 64K regions when erase blocks evenly divide them
+            uint32_t region_size = block_size;
+            if(flash_block_size && flash_block_size <= 0x10000 && (0x10000 % flash_block_size) == 0)
+            {
+                region_size = 0x10000;
+            }
+
+            bool *dirty_blocks = (bool *)malloc(region_size / block_size);
+            uint8_t *scratch = image->block_offsets ? (uint8_t *)malloc(region_size) : NULL;
+            FlashSummary summary = {};
+            RetryReport report = {};
+
+            Journal journal;
+            open_journal(&journal, fd, journal_name, JournalOperation_Flash, image->crc32,
+                         header->flash_content_length, block_size);
+
+            for(uint32_t i = 0; i < header->flash_content_length; i += region_size)
+            {
+                uint32_t length = header->flash_content_length - i < region_size ?
+                                  header->flash_content_length - i : region_size;
+
+                uint8_t *region = get_image_content(image, i, length, scratch);
+                if(!flash_tcrt_region(fd, i, region, length, block_size, dirty_blocks,
+                                      flash_block_size != 0, header->flash_content_length,
+                                      &summary, &report, &journal))
+                {
+                    result = false;
+                    break;
+                }
+            }
+
+            free(scratch);
+            free(dirty_blocks);
+
+            if(!link_progress)
+            {
+                printf("\n");
+            }
+
+            if(interrupted)
+            {
+                print_link_message(stderr, "Interrupted\n");
+            }
+
+            print_retry_report(&report);
+            if(report.failed.count)
+            {
+                result = false;
+            }
+
+            close_journal(&journal, result);
+
+            if(result && diff_flash && !link_progress)
+            {
+                printf("Skipped %u of %u unchanged flash blocks\n",
+                       summary.blocks_skipped, summary.blocks_total);
+            }
+            if(result && verify_flash && !link_progress)
+            {
+                printf("Verified %u written and %u unchanged flash blocks\n",
+                       summary.blocks_verified, summary.blocks_skipped);
+            }
+            if(result && summary.pages_elided && !link_progress)
+            {
+                printf("Skipped %u blank pages (%u bytes)\n", summary.pages_elided, summary.bytes_elided);
+            }
+        }
+        else
+        {
+            print_link_message(stderr, "Failed to read device sizes from Tapecart\n");
+        }
+    }
+
+    return result;
+}
+
+static bool validate_tcrt_header(int fd, TcrtHeader *fileHeader)
+{
+    bool result = false;
+
+    TcrtHeader header = {};
+    if(read_tcrt_header(fd, &header))
+    {
+        if(memcmp(&fileHeader->loadinfo, &header.loadinfo, sizeof(header.loadinfo)) == 0)
+        {
+            if((fileHeader->misc_flags & MiscFlags_InitialLoaderValid) == 0 ||
+               memcmp(&fileHeader->initial_loader, &header.initial_loader, sizeof(header.initial_loader)) == 0)
+            {
+                result = true;
+            }
+            else
+            {
+                print_link_message(stderr, "Initial loader does not match\n");
+            }
+        }
+        else
+        {
+            print_link_message(stderr, "Loadinfo does not match\n");
+        }
+    }
+
+    return result;
+}
+
+static bool validate_tcrt_file(int fd, TcrtImage *image, const char *journal_name)
+{
+    bool result = false;
+
+    TcrtHeader *header = (TcrtHeader *)image->data;
+
+    if(validate_tcrt_header(fd, header))
+    {
+        DeviceSizes device_sizes;
+        if(read_device_sizes(fd, &device_sizes))
+        {
+            result = true;
+            uint32_t flash_block_size = device_sizes.page_size * device_sizes.erase_pages;
+            uint32_t block_size = flash_block_size ? flash_block_size : 4*1024;
+            RetryReport report = {};
+            uint8_t *scratch = image->block_offsets ? (uint8_t *)malloc(block_size) : NULL;
+
+            // Blocks validated by an interrupted run are not checked again
+            Journal journal;
+            open_journal(&journal, fd, journal_name, JournalOperation_Validate, image->crc32,
+                         header->flash_content_length, block_size);
+
+            for(uint32_t i = 0; i < header->flash_content_length && !report.link_lost; i += block_size)
+            {
+                uint32_t block_length = header->flash_content_length - i < block_size ?
+                                        header->flash_content_length - i : block_size;
+
+                if(interrupted)
+                {
+                    print_link_message(stderr, "\nInterrupted\n");
+                    result = false;
+                    break;
+                }
+
+                if(is_block_done(&journal, i))
+                {
+                    continue;
+                }
+
+                uint32_t file_crc32 = calculate_crc32(get_image_content(image, i, block_length, scratch), block_length);
+                uint32_t flash_crc32;
+                bool crc_valid = true;
+
+                for(uint32_t attempt = 0; !crc32_flash(fd, i, block_length, &flash_crc32); attempt++)
+                {
+                    print_link_message(stderr, "Failed to get CRC32 for flash block at address %06x\n", i);
+                    if(!retry_block(fd, i, attempt, &report))
+                    {
+                        crc_valid = false;
+                        break;
+                    }
+                }
+
+                // A mismatch is a real difference, not worth retrying
+                if(crc_valid && file_crc32 != flash_crc32)
+                {
+                    print_link_message(stderr, "CRC32 check failed for flash block at address %06x\n", i);
+                    crc_valid = false;
+                }
+
+                if(crc_valid)
+                {
+                    mark_block_done(&journal, i);
+                    print_progress("Validating", i + block_length, header->flash_content_length);
+                }
+                else
+                {
+                    add_block(&report.failed, i);
+                    result = false;
+                }
+            }
+
+            if(!link_progress)
+            {
+                printf("\n");
+            }
+
+            free(scratch);
+
+            print_retry_report(&report);
+            close_journal(&journal, result);
+            if(result && !link_progress)
             {
-                printf("\nTCRT file matches Tapecart flash\n");
+                printf("TCRT file matches Tapecart flash\n");
             }
         }
         else
         {
-            fprintf(stderr, "Failed to read device sizes from Tapecart\n");
+            print_link_message(stderr, "Failed to read device sizes from Tapecart\n");
         }
     }
 
@@ -5,7 +5,9 @@ enum MiscFlags : uint8_t
 {
     MiscFlags_None =                    0x00,
     MiscFlags_InitialLoaderValid =      0x01,
-    MiscFlags_DataBlockOffsetsSupport = 0x02
+    MiscFlags_DataBlockOffsetsSupport = 0x02,
+    MiscFlags_Compressed =              0x40,   // Content in packed blocks, see compression.cpp
+    MiscFlags_SparseBlankFill =         0x80    // Holes in the file read as 0xFF, see --sparse
 };
 
 #pragma pack(push)
@@ -22,4 +24,14 @@ struct  TcrtHeader
 
     uint32_t flash_content_length;
 };
+
+// Follows the flash content of a MiscFlags_SparseBlankFill file. A copy that
+// fills or creates holes changes the expanded content, this catches it.
+struct SparseTrailer
+{
+    uint8_t signature[8];
+    uint32_t content_crc32;     // Of the flash content with holes read as 0xFF
+};
 #pragma pack(pop)
+
+#define SPARSE_TRAILER_SIGNATURE "TCSPARSE"